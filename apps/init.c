@@ -85,6 +85,7 @@
 #include <ix/timer.h>
 #include <lwip/memp.h>
 #include <net/ip.h>
+#include <nvme/nvme_calib.h>
 #include <reflex.h>
 
 #define MSR_RAPL_POWER_UNIT 1542
@@ -815,7 +816,9 @@ int main(int argc, char *argv[]) {
         }
 
     // ret = echoserver_main(argc - args_parsed, &argv[args_parsed]);
-    if (argc > 1)
+    if (CFG.nvme_calibrate[0])
+        ret = nvme_calibrate(CFG.nvme_calibrate);
+    else if (argc > 1)
         ret = reflex_client_main(argc - args_parsed, &argv[args_parsed]);
     else
         ret = reflex_server_main(argc - args_parsed, &argv[args_parsed]);
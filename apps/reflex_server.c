@@ -59,10 +59,13 @@
 #include <netinet/in.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 // #include <ixev_timer.h>
 #include <ix/list.h>
 #include <ix/mempool.h>
 #include <rte_cycles.h>
+#include <rte_malloc.h>
 #include <rte_timer.h>
 
 #include "reflex.h"
@@ -70,6 +73,7 @@
 #define ROUND_UP(num, multiple) \
     ((((num) + (multiple)-1) / (multiple)) * (multiple))
 #define BATCH_DEPTH 512
+#define RECV_BATCH_DEPTH 32  // GET headers parsed in one pass
 #define NAMESPACE 0
 
 // #define rte_rdtsc() 0
@@ -82,17 +86,59 @@
 #define PAGE_SIZE 4096
 
 #define MAX_NUM_CONTIG_ALLOC_RETRIES 5
+
+/*
+ * PUT payloads are written to flash straight from the received packets if
+ * the device takes sg_entry lists. The packets are held until the write
+ * completes, which keeps the TCP window (TCP_WND in lwipopts.h) from
+ * reopening, so a connection holds at most half of it; other PUTs copy.
+ */
+#define ZC_PUT_MAX_HELD (16 * 1024)
+#define ZC_PUT_MAX_ENTS 16
+
+/*
+ * Zero-copy PUTs of up to NVME_REQ_INLINE_ENTS packets keep the packet list
+ * inline, others take an overflow list of ZC_PUT_MAX_ENTS packets. Each core
+ * has up to NVME_REQS_PER_CORE requests outstanding, and enough pages for
+ * all of them to be 16KB.
+ */
+#define NVME_REQ_INLINE_ENTS 4
+#define NVME_REQ_SGL_SIZE (ZC_PUT_MAX_ENTS * sizeof(struct sg_entry))
+#define NVME_REQS_PER_CORE 4096
+#define NVME_BUF_PAGES_PER_CORE (NVME_REQS_PER_CORE * 4)
+
+/*
+ * nvme bufs come from a per-core buddy allocator over hugepage memory, so
+ * a request gets one contiguous buffer of up to MAX_PAGES_PER_ACCESS pages
+ * in one call, and the device reads or writes it with PRPs. The arena is
+ * aligned to the largest block, which keeps blocks within a 2MB hugepage.
+ */
+#define NVME_BUF_MAX_ORDER 8  // log2(MAX_PAGES_PER_ACCESS)
+#define NVME_BUF_MAX_LEN (PAGE_SIZE << NVME_BUF_MAX_ORDER)
+#define NVME_BUF_FREE 0x80    // first page of a free block, | its order
+#define NVME_BUF_TAIL 0xff    // not the first page of a block
 // #define MAX_LATENCY 2000
 
 #define TIMER_RESOLUTION_CYCLES 250ULL /* around 2 us at 125Mhz */
 
-static int outstanding_reqs = 4096 * 64;
-static int outstanding_req_bufs = 4096 * 64;  // 4096 * 64;
+static int outstanding_reqs;      // NVME_REQS_PER_CORE per core
+static int outstanding_req_sgls;  // overflow lists
 static unsigned long ns_size;
 static unsigned long ns_sector_size = 512;  // use for now
+static unsigned long ns_open_flags;         // NVME_OPEN_*
+
+struct nvme_buf_block {
+    struct list_node link;
+};
 
-static struct mempool_datastore nvme_req_buf_datastore;
-static __thread struct mempool nvme_req_buf_pool;
+static __thread char *nvme_buf_arena;
+static __thread uint8_t *nvme_buf_page_state;  // order of each block
+static __thread unsigned long nvme_buf_nr_pages;
+static __thread struct list_head nvme_buf_free_list[NVME_BUF_MAX_ORDER + 1];
+static __thread unsigned int nvme_buf_free_mask;  // non-empty free lists
+
+static struct mempool_datastore nvme_req_sgl_datastore;
+static __thread struct mempool nvme_req_sgl_pool;
 
 static struct mempool_datastore nvme_req_datastore;
 static __thread struct mempool nvme_req_pool;
@@ -126,8 +172,13 @@ struct nvme_req {
     struct ixev_ref ref;  // for zero-copy
     unsigned long timestamp;
     void *remote_req_handle;
-    char *buf[MAX_PAGES_PER_ACCESS];  // nvme buffer to read/write data into
-    int current_sgl_buf;
+    BINARY_HEADER resp;  // response header, sent zero-copy
+    char *buf;  // contiguous nvme buffer to read/write data into
+    // zero-copy PUT: the payload stays in the received packets
+    int zc_nrents;  // 0 if copied into buf, < 0 if held to be copied
+    struct sg_entry *zc;
+    struct ixev_recv_ref rref;
+    struct sg_entry zc_inline[NVME_REQ_INLINE_ENTS];
 };
 
 struct pp_conn {
@@ -143,9 +194,13 @@ struct pp_conn {
     unsigned long req_received;
     struct list_head pending_requests;
     long nvme_fg_handle;  // nvme flow group handle
-    long conn_fg_handle;  // set for src_port for now
+    long conn_fg_handle;  // src_port, or the tenant id from CMD_REG
     struct nvme_req *current_req;
-    char data_send[sizeof(BINARY_HEADER)];  // use zero-copy for payload
+    bool rx_zc;      // the current PUT is received without copying
+    size_t zc_held;  // bytes of received packets held by PUTs
+    bool hup;        // close once zc_held drops to 0
+    bool hup_unregister;  // and unregister the flow first
+    char data_send[sizeof(BINARY_HEADER)];  // CMD_REG response
     char data_recv[sizeof(BINARY_HEADER)];  // use zero-copy for payload
 };
 
@@ -186,36 +241,155 @@ static void send_again_cb(__attribute__((unused)) struct rte_timer *tim,
     // printf("Send succeeded this time.\n");
 }
 
+static void nvme_buf_link(unsigned long pg, unsigned int order) {
+    struct nvme_buf_block *blk =
+        (struct nvme_buf_block *)(nvme_buf_arena + pg * PAGE_SIZE);
+
+    list_add(&nvme_buf_free_list[order], &blk->link);
+    nvme_buf_free_mask |= 1u << order;
+    nvme_buf_page_state[pg] = order | NVME_BUF_FREE;
+}
+
+static void nvme_buf_unlink(unsigned long pg, unsigned int order) {
+    struct nvme_buf_block *blk =
+        (struct nvme_buf_block *)(nvme_buf_arena + pg * PAGE_SIZE);
+
+    list_del(&blk->link);
+    if (list_empty(&nvme_buf_free_list[order]))
+        nvme_buf_free_mask &= ~(1u << order);
+    nvme_buf_page_state[pg] = NVME_BUF_TAIL;
+}
+
+/*
+ * nvme_buf_init - set up the buffer arena of this core
+ */
+static int nvme_buf_init(unsigned long nr_pages) {
+    unsigned long pg;
+    int i;
+
+    nr_pages = ROUND_UP(nr_pages, 1ul << NVME_BUF_MAX_ORDER);
+    nvme_buf_arena = rte_malloc("nvme_buf_arena", nr_pages * PAGE_SIZE,
+                                PAGE_SIZE << NVME_BUF_MAX_ORDER);
+    nvme_buf_page_state = malloc(nr_pages);
+    if (!nvme_buf_arena || !nvme_buf_page_state) return -ENOMEM;
+    memset(nvme_buf_page_state, NVME_BUF_TAIL, nr_pages);
+    nvme_buf_nr_pages = nr_pages;
+
+    for (i = 0; i <= NVME_BUF_MAX_ORDER; i++)
+        list_head_init(&nvme_buf_free_list[i]);
+    nvme_buf_free_mask = 0;
+    for (pg = 0; pg < nr_pages; pg += 1ul << NVME_BUF_MAX_ORDER)
+        nvme_buf_link(pg, NVME_BUF_MAX_ORDER);
+    return 0;
+}
+
+/*
+ * nvme_buf_alloc - allocate a contiguous buffer of len bytes
+ *
+ * The smallest free block that fits is split in halves down to the
+ * power-of-two number of pages needed.
+ */
+static char *nvme_buf_alloc(size_t len) {
+    unsigned int order = 0, o, mask;
+    struct nvme_buf_block *blk;
+    unsigned long pg;
+
+    while ((PAGE_SIZE << order) < len) order++;
+    assert(order <= NVME_BUF_MAX_ORDER);
+
+    mask = nvme_buf_free_mask >> order;
+    if (!mask) return NULL;
+    o = order + __builtin_ctz(mask);
+
+    blk = list_top(&nvme_buf_free_list[o], struct nvme_buf_block, link);
+    pg = ((char *)blk - nvme_buf_arena) / PAGE_SIZE;
+    nvme_buf_unlink(pg, o);
+    while (o > order) {
+        o--;
+        nvme_buf_link(pg + (1ul << o), o);
+    }
+    nvme_buf_page_state[pg] = order;
+    return (char *)blk;
+}
+
+/*
+ * nvme_buf_free - free a buffer, merging it with its free buddies
+ */
+static void nvme_buf_free(char *buf) {
+    unsigned long pg = (buf - nvme_buf_arena) / PAGE_SIZE, buddy;
+    unsigned int order = nvme_buf_page_state[pg];
+
+    nvme_buf_page_state[pg] = NVME_BUF_TAIL;
+    while (order < NVME_BUF_MAX_ORDER) {
+        buddy = pg ^ (1ul << order);
+        if (nvme_buf_page_state[buddy] != (order | NVME_BUF_FREE)) break;
+        nvme_buf_unlink(buddy, order);
+        pg &= ~(1ul << order);
+        order++;
+    }
+    nvme_buf_link(pg, order);
+}
+
+/*
+ * pp_close - close a connection, after unregistering its flow if asked
+ *
+ * The stack frees received packets on close, so while PUTs are written
+ * from them the close waits for their writes, see nvme_written_cb().
+ */
+static void pp_close(struct pp_conn *conn, bool unregister) {
+    if (conn->zc_held) {
+        conn->hup = true;
+        conn->hup_unregister |= unregister;
+        return;
+    }
+    conn->hup = false;
+    if (unregister) ixev_nvme_unregister_flow(conn->nvme_fg_handle);
+    ixev_close(&conn->ctx);
+}
+
+static void free_req_zc(struct nvme_req *req) {
+    if (req->zc != req->zc_inline) {
+        mempool_free(&nvme_req_sgl_pool, req->zc);
+        req->zc = req->zc_inline;
+    }
+}
+
+static void free_req(struct nvme_req *req) {
+    if (req->buf) nvme_buf_free(req->buf);
+    free_req_zc(req);
+    mempool_free(&nvme_req_pool, req);
+    reqs_allocated--;
+}
+
 static void send_completed_cb(struct ixev_ref *ref) {
     struct nvme_req *req = container_of(ref, struct nvme_req, ref);
-    struct pp_conn *conn = req->conn;
-    int i, num4k;
     unsigned long curr_sent_time =
         (rte_rdtsc() - req->timestamp) / cycles_per_us;
     send_avg += curr_sent_time;
 
-    num4k = (req->lba_count * ns_sector_size) / 4096;
-    if (((req->lba_count * ns_sector_size) % 4096) != 0) num4k++;
-    for (i = 0; i < num4k; i++) {
-        mempool_free(&nvme_req_buf_pool, req->buf[i]);
-    }
-
-    mempool_free(&nvme_req_pool, req);
-    reqs_allocated--;
+    free_req(req);
 }
 
 /*
- * returns 0 if send was successfull and -1 if tx path is busy
+ * returns 0 if send was successfull, -1 if tx path is busy and -2 if the
+ * connection is dead
+ *
+ * The header and the payload go out zero-copy in one ixev_sendv_zc(), and
+ * the req is freed once the peer acked both.
  */
 int send_req(struct nvme_req *req) {
     struct pp_conn *conn = req->conn;
-    int ret = 0;
-    BINARY_HEADER *header;
+    BINARY_HEADER *header = &req->resp;
+    struct sg_entry ents[2];
+    size_t payload_len, total_len;
+    int nrents = 0;
+    ssize_t ret;
+
+    payload_len = req->opcode == CMD_GET ? req->lba_count * ns_sector_size : 0;
+    total_len = sizeof(BINARY_HEADER) + payload_len;
 
     if (!conn->tx_pending) {
         // setup header
-        // printf("Now req->opcode is %d\n", req->opcode);
-        header = (BINARY_HEADER *)&conn->data_send[0];
         header->magic = sizeof(BINARY_HEADER);  // RESP_PKT;
         header->opcode = req->opcode;
         header->lba = req->lba;
@@ -228,84 +402,62 @@ int send_req(struct nvme_req *req) {
 
         assert(header->req_handle);
 
-        while (conn->tx_sent < (sizeof(BINARY_HEADER))) {
-            ret = ixev_send(&conn->ctx, &conn->data_send[conn->tx_sent],
-                            sizeof(BINARY_HEADER) - conn->tx_sent);
-            if (ret == -ENOBUFS) {
-                failed_header_sents_0++;
-            } else if (ret == -EAGAIN) {
-                failed_header_sents_1++;
-            } else if (ret < 0) {
-                failed_other_sents_0++;
-            }
-
-            if (ret < 0) {
-                if (!conn->nvme_pending) {
-                    log_err("ixev_send ret < 0, then ivev_close.\n");
-                    ixev_close(&conn->ctx);
-                    return -2;
-                }
-                return -1;
-                ret = 0;
-            }
-            conn->tx_sent += ret;
-        }
-
         conn->tx_pending = true;
         conn->tx_sent = 0;
     }
-    ret = 0;
-    // printf("break point: opcode is %d\n", req->opcode);
-    if (req->opcode == CMD_GET) {
-        // printf("Sending GET payloads of %d bytes\n", req->lba_count *
-        // ns_sector_size);
-        while (conn->tx_sent < req->lba_count * ns_sector_size) {
-            int to_send =
-                min(PAGE_SIZE - (conn->tx_sent % PAGE_SIZE),
-                    (req->lba_count * ns_sector_size) - conn->tx_sent);
-
-            ret = ixev_send_zc(
-                &conn->ctx,
-                &req->buf[req->current_sgl_buf][conn->tx_sent % PAGE_SIZE],
-                to_send);
-            if (ret < 0) {
-                if (ret == -ENOBUFS) {
+
+    while (conn->tx_sent < total_len) {
+        nrents = 0;
+        if (conn->tx_sent < sizeof(BINARY_HEADER)) {
+            ents[nrents].base = (char *)header + conn->tx_sent;
+            ents[nrents].len = sizeof(BINARY_HEADER) - conn->tx_sent;
+            nrents++;
+        }
+        if (payload_len) {
+            size_t off = conn->tx_sent > sizeof(BINARY_HEADER)
+                             ? conn->tx_sent - sizeof(BINARY_HEADER)
+                             : 0;
+
+            ents[nrents].base = &req->buf[off];
+            ents[nrents].len = payload_len - off;
+            nrents++;
+        }
+
+        ret = ixev_sendv_zc(&conn->ctx, ents, nrents);
+        if (ret < 0) {
+            bool in_header = conn->tx_sent < sizeof(BINARY_HEADER);
+
+            if (ret == -ENOBUFS) {
+                if (in_header)
+                    failed_header_sents_0++;
+                else
                     failed_payload_sents_0++;
-                } else if (ret == -EAGAIN) {
+            } else if (ret == -EAGAIN) {
+                if (in_header)
+                    failed_header_sents_1++;
+                else
                     failed_payload_sents_1++;
-                } else if (ret < 0) {
+            } else {  // -EIO, the connection is dead
+                if (in_header)
+                    failed_other_sents_0++;
+                else
                     failed_other_sents_1++;
-                }
                 if (!conn->nvme_pending) {
-                    log_err("Connection close 3\n");
-                    ixev_close(&conn->ctx);
+                    log_err("ixev_sendv_zc ret < 0, then ixev_close.\n");
+                    pp_close(conn, false);
                 }
-
                 return -2;
             }
-            if (ret == 0) log_err("fhmm ret is zero\n");
-
-            conn->tx_sent += ret;
-            if ((conn->tx_sent % PAGE_SIZE) == 0) req->current_sgl_buf++;
-        }
-        assert(req->current_sgl_buf <= req->lba_count);
-        req->ref.cb = &send_completed_cb;
-        req->ref.send_pos = req->lba_count * ns_sector_size;
-        ixev_add_sent_cb(&conn->ctx, &req->ref);
-    } else {  // PUT
-        int i, num4k;
-        num4k = (req->lba_count * ns_sector_size) / 4096;
-        if (((req->lba_count * ns_sector_size) % 4096) != 0) num4k++;
-        for (i = 0; i < num4k; i++) {
-            mempool_free(&nvme_req_buf_pool, req->buf[i]);
+            return -1;
         }
-        mempool_free(&nvme_req_pool, req);
-        reqs_allocated--;
-        unsigned long curr_sent_time =
-            (rte_rdtsc() - req->timestamp) / cycles_per_us;
-        send_avg += curr_sent_time;
-        // conn->sent_pkts--;
+        if (ret == 0) log_err("fhmm ret is zero\n");
+
+        conn->tx_sent += ret;
     }
+
+    req->ref.cb = &send_completed_cb;
+    ixev_add_sent_cb(&conn->ctx, &req->ref);
+
     conn->list_len--;
     conn->tx_sent = 0;
     conn->tx_pending = false;
@@ -349,6 +501,12 @@ static void nvme_written_cb(struct ixev_nvme_req_ctx *ctx,
                             unsigned int reason) {
     struct nvme_req *req = container_of(ctx, struct nvme_req, ctx);
     struct pp_conn *conn = req->conn;
+
+    // the packets the payload was written from can go
+    if (req->zc_nrents) {
+        ixev_recv_release(&conn->ctx, &req->rref);
+        conn->zc_held -= req->lba_count * ns_sector_size;
+    }
     /*
         int num_bytes = req->lba_count * 512;
         int num_4kbufs = num_bytes /4096 + 1;
@@ -369,6 +527,8 @@ static void nvme_written_cb(struct ixev_nvme_req_ctx *ctx,
     local_avg += (rte_rdtsc() - req->timestamp) / cycles_per_us;
     num_requests++;
     send_pending_reqs(conn);
+    // the last write from the packets of a closing connection
+    if (conn->hup && !conn->zc_held) pp_close(conn, conn->hup_unregister);
     return;
 }
 
@@ -406,9 +566,11 @@ static void nvme_response_cb(struct ixev_nvme_req_ctx *ctx,
 }
 
 static void nvme_opened_cb(hqu_t _handle, unsigned long _ns_size,
-                           unsigned long _ns_sector_size) {
+                           unsigned long _ns_sector_size,
+                           unsigned long _ns_open_flags) {
     ns_size = _ns_size;
     ns_sector_size = _ns_sector_size;
+    ns_open_flags = _ns_open_flags;
     if (ns_size) {
         handle = _handle;
     }
@@ -448,7 +610,7 @@ static void nvme_registered_flow_cb(long fg_handle, struct ixev_ctx *ctx,
         if (ret < 0) {
             if (!conn->nvme_pending) {
                 log_err("ixev_send ret < 0, then ivev_close.\n");
-                ixev_close(&conn->ctx);
+                pp_close(conn, false);
                 return -2;
             }
             return -1;
@@ -471,31 +633,220 @@ static struct ixev_nvme_ops nvme_ops = {
     .unregistered_flow = &nvme_unregistered_flow_cb,
 };
 
+/*
+ * alloc_req_buf - allocate the nvme buf of a request of len bytes
+ *
+ * Returns -ENOMEM if the arena is exhausted, the caller then retries once
+ * other requests complete.
+ */
+static int alloc_req_buf(struct nvme_req *req, size_t len) {
+    req->buf = nvme_buf_alloc(len);
+    return req->buf ? 0 : -ENOMEM;
+}
+
+static bool zc_aligned(struct sg_entry *ents, int n) {
+    int i;
+
+    if (!(ns_open_flags & NVME_OPEN_SG_DWORD)) return true;
+    for (i = 0; i < n; i++)
+        if (((uintptr_t)ents[i].base | ents[i].len) & 3) return false;
+    return true;
+}
+
+/*
+ * receive_put_zc - hold the payload of a PUT in the received packets
+ *
+ * If the packets can't be handed to the device (too many or misaligned),
+ * the payload is copied into nvme bufs instead, as far as it has arrived.
+ * Returns -EAGAIN if the payload is incomplete, or if there are no bufs to
+ * copy it to yet.
+ */
+static int receive_put_zc(struct pp_conn *conn, struct nvme_req *req,
+                          size_t len) {
+    int n = -req->zc_nrents, i;
+    size_t pos = 0;
+
+    if (!n) {
+        n = ixev_recv_hold(&conn->ctx, len, req->zc,
+                           req->zc == req->zc_inline ? NVME_REQ_INLINE_ENTS
+                                                     : ZC_PUT_MAX_ENTS,
+                           &req->rref);
+        if (n == -ENOBUFS && req->zc == req->zc_inline) {
+            req->zc = mempool_alloc(&nvme_req_sgl_pool);
+            if (req->zc)
+                n = ixev_recv_hold(&conn->ctx, len, req->zc, ZC_PUT_MAX_ENTS,
+                                   &req->rref);
+            else
+                req->zc = req->zc_inline;
+        }
+        if (n == -EAGAIN) return -EAGAIN;
+        if (n > 0 && zc_aligned(req->zc, n)) {
+            req->zc_nrents = n;
+            conn->zc_held += len;
+            return 0;
+        }
+    }
+
+    if (alloc_req_buf(req, len)) {
+        // keep what is held until bufs are back
+        if (n > 0) req->zc_nrents = -n;
+        return -EAGAIN;
+    }
+    req->zc_nrents = 0;
+    conn->rx_zc = false;
+    if (n > 0) {
+        for (i = 0; i < n; i++) {
+            memcpy(&req->buf[pos], req->zc[i].base, req->zc[i].len);
+            pos += req->zc[i].len;
+        }
+        ixev_recv_release(&conn->ctx, &req->rref);
+        conn->rx_received = len;
+    }
+    free_req_zc(req);
+    return 0;
+}
+
+static void init_req(struct pp_conn *conn, struct nvme_req *req,
+                     BINARY_HEADER *header) {
+    req->opcode = header->opcode;
+    req->lba_count = header->lba_count;
+    req->lba = header->lba;
+    req->remote_req_handle = header->req_handle;
+    req->zc = req->zc_inline;
+    req->zc_nrents = 0;
+    ixev_nvme_req_ctx_init(&req->ctx);
+    req->ctx.handle = handle;
+    req->conn = conn;
+    reqs_allocated++;
+}
+
+/*
+ * submit_req - issue a request once its payload is in
+ */
+static void submit_req(struct pp_conn *conn, struct nvme_req *req) {
+    void *nvme_addr;
+
+    nvme_addr = (void *)(req->lba << 9);
+    if (nvme_addr >= ns_size) {
+        printf("nvme_addr: %lu is larger than ns_size: %lu.\n",
+               (unsigned long)nvme_addr, ns_size);
+    }
+    assert((unsigned long)nvme_addr < ns_size);
+
+    conn->in_flight_pkts++;
+
+    req->timestamp = rte_rdtsc();
+    switch (req->opcode) {
+        case CMD_SET:
+            ixev_set_nvme_handler(&req->ctx, IXEV_NVME_WR, &nvme_written_cb);
+#ifndef NVME_ENABLE
+            nvme_written_cb(&req->ctx, IXEV_NVME_WR);
+#else
+            if (req->zc_nrents)
+                ixev_nvme_writev_sg(conn->nvme_fg_handle, req->zc,
+                                    req->zc_nrents, req->lba, req->lba_count,
+                                    (unsigned long)&req->ctx);
+            else
+                ixev_nvme_write(conn->nvme_fg_handle, req->buf, req->lba,
+                                req->lba_count, (unsigned long)&req->ctx);
+#endif
+            conn->nvme_pending++;
+            break;
+        case CMD_GET:
+            ixev_set_nvme_handler(&req->ctx, IXEV_NVME_RD, &nvme_response_cb);
+#ifndef NVME_ENABLE
+            // printf("Received GET msg - early reply\n");
+            nvme_response_cb(&req->ctx, IXEV_NVME_RD);
+#else
+            ixev_nvme_read(conn->nvme_fg_handle, req->buf, req->lba,
+                           req->lba_count, (unsigned long)&req->ctx);
+#endif
+            conn->nvme_pending++;
+            break;
+        case CMD_REG:
+            log_err("Should not see this choice here.\n");
+            break;
+        default:
+            printf("Received illegal msg (opcode-%d) - dropping msg\n",
+                   req->opcode);
+            free_req(req);
+    }
+}
+
+/*
+ * receive_get_batch - take the GETs at the head of the received data in
+ * one pass
+ *
+ * Clients pipeline small GETs, so many headers tend to sit back to back in
+ * one packet. They are parsed in place, their reqs are allocated together,
+ * and the reads all go into the current syscall batch. Anything else is
+ * left to receive_req(), which also rejects a GET too large for an nvme buf.
+ *
+ * Returns the number of GETs taken.
+ */
+static int receive_get_batch(struct pp_conn *conn) {
+    struct nvme_req *reqs[RECV_BATCH_DEPTH];
+    BINARY_HEADER *headers;
+    size_t avail;
+    int n, i;
+
+    headers = ixev_recv_peek(&conn->ctx, &avail);
+    if (!headers) return 0;
+
+    avail /= sizeof(BINARY_HEADER);
+    for (n = 0; n < avail && n < RECV_BATCH_DEPTH; n++)
+        if (headers[n].magic != sizeof(BINARY_HEADER) ||
+            headers[n].opcode != CMD_GET ||
+            headers[n].lba_count * ns_sector_size > NVME_BUF_MAX_LEN)
+            break;
+    if (!n || mempool_alloc_bulk(&nvme_req_pool, (void **)reqs, n)) return 0;
+
+    for (i = 0; i < n; i++)
+        if (alloc_req_buf(reqs[i], headers[i].lba_count * ns_sector_size))
+            break;
+    if (i < n) {
+        mempool_free_bulk(&nvme_req_pool, (void **)&reqs[i], n - i);
+        n = i;
+    }
+
+    for (i = 0; i < n; i++) {
+        init_req(conn, reqs[i], &headers[i]);
+        submit_req(conn, reqs[i]);
+    }
+
+    ixev_recv_zc(&conn->ctx, n * sizeof(BINARY_HEADER));
+    return n;
+}
+
 static void receive_req(struct pp_conn *conn) {
     ssize_t ret;
     struct nvme_req *req;
     BINARY_HEADER *header;
-    void *nvme_addr;
 
     while (1) {
-        int num4k;
         if (!conn->rx_pending) {
-            int i;
+            size_t len;
 
-            ret = ixev_recv(&conn->ctx, &conn->data_recv[conn->rx_received],
-                            sizeof(BINARY_HEADER) - conn->rx_received);
-            if (ret <= 0) {
-                if (ret != -EAGAIN) {
-                    if (!conn->nvme_pending) {
-                        log_err("Connection close 6\n");
-                        ixev_close(&conn->ctx);
+            if (!conn->rx_received && receive_get_batch(conn)) continue;
+
+            // the header may be in already, waiting for a free req
+            if (conn->rx_received < sizeof(BINARY_HEADER)) {
+                ret = ixev_recv(&conn->ctx,
+                                &conn->data_recv[conn->rx_received],
+                                sizeof(BINARY_HEADER) - conn->rx_received);
+                if (ret <= 0) {
+                    if (ret != -EAGAIN) {
+                        if (!conn->nvme_pending) {
+                            log_err("Connection close 6\n");
+                            pp_close(conn, false);
+                        }
                     }
-                }
-                return;
-            } else
-                conn->rx_received += ret;
+                    return;
+                } else
+                    conn->rx_received += ret;
 
-            if (conn->rx_received < sizeof(BINARY_HEADER)) return;
+                if (conn->rx_received < sizeof(BINARY_HEADER)) return;
+            }
 
             // received the header
             header = (BINARY_HEADER *)&conn->data_recv[0];
@@ -513,15 +864,35 @@ static void receive_req(struct pp_conn *conn) {
                 unsigned long IOPS_SLO = header->lba;
                 unsigned int latency_us_SLO = header->lba_count >> 7;
                 int rw_ratio_SLO = header->lba_count & 0x0000007f;
+                unsigned int be_weight = (uintptr_t)header->req_handle;
+                unsigned long tenant_id =
+                    (uintptr_t)header->req_handle >> 32;
 
+                // connections of a tenant share its SLO across cores
+                if (tenant_id)
+                    conn->conn_fg_handle = NVME_FG_TENANT | tenant_id;
                 ixev_nvme_register_flow(conn->conn_fg_handle, cookie,
                                         latency_us_SLO, IOPS_SLO,
-                                        rw_ratio_SLO);
+                                        rw_ratio_SLO, be_weight);
 
                 conn->rx_received = 0;
                 continue;
             }
 
+            if (header->opcode != CMD_SET && header->opcode != CMD_GET) {
+                printf("Received unsupported command, closing connection\n");
+                pp_close(conn, false);
+                return;
+            }
+
+            len = header->lba_count * ns_sector_size;
+            if (len > NVME_BUF_MAX_LEN) {
+                printf("Request of %lu bytes exceeds %d, closing connection\n",
+                       len, NVME_BUF_MAX_LEN);
+                pp_close(conn, false);
+                return;
+            }
+
             // allocate nvme req
             conn->current_req = mempool_alloc(&nvme_req_pool);
             if (!conn->current_req) {
@@ -531,131 +902,50 @@ static void receive_req(struct pp_conn *conn) {
                     conn->in_flight_pkts, conn->sent_pkts, conn->list_len);
                 return;
             }
-            conn->current_req->current_sgl_buf = 0;
-
-            // allocate lba_count sector sized nvme bufs
-            num4k = (header->lba_count * ns_sector_size) / 4096;
-            assert(num4k <= MAX_PAGES_PER_ACCESS);
-            if (((header->lba_count * ns_sector_size) % 4096) != 0) num4k++;
-
-            for (i = 0; i < num4k; i++) {
-                conn->current_req->buf[i] = mempool_alloc(&nvme_req_buf_pool);
-                if (conn->current_req->buf[i] == NULL) {
-                    printf("ERROR: alloc of nvme_req_buf failed\n");
-                    assert(0);
-                }
-                // printf("conn->current_req->buf[%d] is %p, expect next %x\n",
-                //        i, conn->current_req->buf[i],
-                //        (uint64_t)(conn->current_req->buf[i]) - 4096);
-            }
-            // printf("req buf is %p\n", conn->current_req->buf[0]);
 
-            ixev_nvme_req_ctx_init(&conn->current_req->ctx);
+            // allocate lba_count sector sized nvme bufs, unless the PUT
+            // payload can be written from the received packets
+            conn->rx_zc = header->opcode == CMD_SET &&
+                          (ns_open_flags & NVME_OPEN_SG_ENTRIES) &&
+                          conn->zc_held + len <= ZC_PUT_MAX_HELD;
+            conn->current_req->buf = NULL;
+            if (!conn->rx_zc && alloc_req_buf(conn->current_req, len)) {
+                mempool_free(&nvme_req_pool, conn->current_req);
+                return;
+            }
+            init_req(conn, conn->current_req, header);
 
-            reqs_allocated++;
             conn->rx_pending = true;
             conn->rx_received = 0;
         }
 
         req = conn->current_req;
-        header = (BINARY_HEADER *)&conn->data_recv[0];
 
-        assert(header->magic == sizeof(BINARY_HEADER));
+        if (req->opcode == CMD_SET) {
+            size_t len = req->lba_count * ns_sector_size;
 
-        if (header->opcode == CMD_SET) {
-            while (conn->rx_received < header->lba_count * ns_sector_size) {
-                int to_receive = min(
-                    PAGE_SIZE - (conn->rx_received % PAGE_SIZE),
-                    (header->lba_count * ns_sector_size) - conn->rx_received);
+            if (conn->rx_zc && receive_put_zc(conn, req, len) == -EAGAIN)
+                return;
 
-                ret = ixev_recv(&conn->ctx,
-                                &req->buf[req->current_sgl_buf]
-                                         [conn->rx_received % PAGE_SIZE],
-                                to_receive);
+            while (conn->rx_received < len) {
+                ret = ixev_recv(&conn->ctx, &req->buf[conn->rx_received],
+                                len - conn->rx_received);
 
                 if (ret < 0) {
                     if (ret == -EAGAIN) return;
 
                     if (!conn->nvme_pending) {
                         printf("Connection close 3\n");
-                        ixev_close(&conn->ctx);
+                        pp_close(conn, false);
                     }
                     return;
                 }
 
                 conn->rx_received += ret;
-                if ((conn->rx_received % PAGE_SIZE) == 0) {
-                    req->current_sgl_buf++;
-                }
             }
-            // 4KB sgl bufs should match number of 512B sectors
-            assert(req->current_sgl_buf <= header->lba_count * 8);
-        } else if (header->opcode == CMD_GET) {
-        } else {
-            printf("Received unsupported command, closing connection\n");
-            ixev_close(&conn->ctx);
-            return;
         }
 
-        req->opcode = header->opcode;
-        req->lba_count = header->lba_count;
-        req->lba = header->lba;
-        req->remote_req_handle = header->req_handle;
-
-        req->ctx.handle = handle;
-        req->conn = conn;
-
-        nvme_addr = (void *)(header->lba << 9);
-        if (nvme_addr >= ns_size) {
-            printf("nvme_addr: %lu is larger than ns_size: %lu.\n",
-                   (unsigned long)nvme_addr, ns_size);
-        }
-        assert((unsigned long)nvme_addr < ns_size);
-
-        conn->in_flight_pkts++;
-        num4k = (header->lba_count * ns_sector_size) / PAGE_SIZE;
-        if (((header->lba_count * ns_sector_size) % PAGE_SIZE) != 0) num4k++;
-
-        req->timestamp = rte_rdtsc();
-        switch (header->opcode) {
-            case CMD_SET:
-                ixev_set_nvme_handler(&req->ctx, IXEV_NVME_WR,
-                                      &nvme_written_cb);
-#ifndef NVME_ENABLE
-                nvme_written_cb(&req->ctx, IXEV_NVME_WR);
-#else
-                // ixev_nvme_write(conn->nvme_fg_handle, req->buf[0],
-                // header->lba, header->lba_count, (unsigned long)&req->ctx);
-                ixev_nvme_writev(conn->nvme_fg_handle, (void **)&req->buf[0],
-                                 num4k, header->lba, header->lba_count,
-                                 (unsigned long)&req->ctx);
-#endif
-                conn->nvme_pending++;
-                break;
-            case CMD_GET:
-                ixev_set_nvme_handler(&req->ctx, IXEV_NVME_RD,
-                                      &nvme_response_cb);
-#ifndef NVME_ENABLE
-                // printf("Received GET msg - early reply\n");
-                nvme_response_cb(&req->ctx, IXEV_NVME_RD);
-#else
-                // ixev_nvme_read(conn->nvme_fg_handle, req->buf[0],
-                // header->lba, header->lba_count, (unsigned long)&req->ctx);
-                ixev_nvme_readv(conn->nvme_fg_handle, (void **)&req->buf[0],
-                                num4k, header->lba, header->lba_count,
-                                (unsigned long)&req->ctx);
-#endif
-                conn->nvme_pending++;
-                break;
-            case CMD_REG:
-                log_err("Should not see this choice here.\n");
-                break;
-            default:
-                printf("Received illegal msg (opcode-%d) - dropping msg\n",
-                       header->opcode);
-                mempool_free(&nvme_req_pool, req);
-                reqs_allocated--;
-        }
+        submit_req(conn, req);
         conn->rx_received = 0;
         conn->rx_pending = false;
     }
@@ -669,7 +959,6 @@ static void pp_main_handler(struct ixev_ctx *ctx, unsigned int reason) {
         send_pending_reqs(conn);
     }
     if (reason == IXEVHUP) {
-        ixev_nvme_unregister_flow(conn->nvme_fg_handle);
         if (num_requests > 0) {
             printf(
                 "Thread %d: IXEVHUP: Connection closed.\nAvg nvme latency was "
@@ -695,7 +984,7 @@ static void pp_main_handler(struct ixev_ctx *ctx, unsigned int reason) {
         failed_other_sents_0 = failed_header_sents_1 = 0;
         // failed_resend_attempts = 0;
         // successful_resend_attempts = 0;
-        ixev_close(&conn->ctx);
+        pp_close(conn, true);
         return;
     }
     receive_req(conn);
@@ -715,6 +1004,10 @@ static struct ixev_ctx *pp_accept(struct ip_tuple *id) {
     list_head_init(&conn->pending_requests);
     conn->rx_received = 0;
     conn->rx_pending = false;
+    conn->rx_zc = false;
+    conn->zc_held = 0;
+    conn->hup = false;
+    conn->hup_unregister = false;
     conn->tx_sent = 0;
     conn->tx_pending = false;
     conn->in_flight_pkts = 0x0UL;
@@ -779,7 +1072,13 @@ void *pp_main(void *arg) {
         return NULL;
     }
 
-    ret = mempool_create(&nvme_req_buf_pool, &nvme_req_buf_datastore,
+    ret = nvme_buf_init(NVME_BUF_PAGES_PER_CORE);
+    if (ret) {
+        fprintf(stderr, "unable to allocate nvme buf arena\n");
+        return NULL;
+    }
+
+    ret = mempool_create(&nvme_req_sgl_pool, &nvme_req_sgl_datastore,
                          MEMPOOL_SANITY_GLOBAL, 0);
     if (ret) {
         fprintf(stderr, "unable to create mempool\n");
@@ -823,6 +1122,11 @@ int reflex_server_main(int argc, char *argv[]) {
         exit(-1);
     }
 
+    // zero-copy PUTs are at most ZC_PUT_MAX_HELD per connection, few of
+    // them spread over more than NVME_REQ_INLINE_ENTS packets
+    outstanding_reqs = nr_cpu * NVME_REQS_PER_CORE;
+    outstanding_req_sgls = outstanding_reqs / 4;
+
     ret =
         mempool_create_datastore(&nvme_req_datastore, outstanding_reqs,
                                  sizeof(struct nvme_req), "nvme_req_datastore");
@@ -845,10 +1149,9 @@ int reflex_server_main(int argc, char *argv[]) {
         return ret;
     }
 
-    ret = mempool_create_datastore_align(&nvme_req_buf_datastore,
-                                         outstanding_req_bufs, PAGE_SIZE,
-                                         "nvme_req_buf_datastore");
-
+    ret = mempool_create_datastore(&nvme_req_sgl_datastore,
+                                   outstanding_req_sgls, NVME_REQ_SGL_SIZE,
+                                   "nvme_req_sgl_datastore");
     if (ret) {
         fprintf(stderr, "unable to create datastore\n");
         return ret;
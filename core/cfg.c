@@ -105,7 +105,13 @@ static int parse_arp(void);
 static int parse_devices(void);
 static int parse_nvme_devices(void);
 static int parse_ns_sizes(void);
+static int parse_nvme_stripe(void);
 static int parse_nvme_device_model(void);
+static int parse_nvme_queue_depth(void);
+static int parse_nvme_tail_control(void);
+static int parse_nvme_calibrate(void);
+static int parse_nvme_merge_size(void);
+static int parse_nvme_max_cmd_size(void);
 static int parse_cpu(void);
 // static int parse_mem_channel(void);
 static int parse_batch(void);
@@ -132,7 +138,13 @@ static struct config_vector_t config_tbl[] = {
     {"devices", parse_devices},
     {"nvme_devices", parse_nvme_devices},
     {"ns_sizes", parse_ns_sizes},
+    {"nvme_stripe", parse_nvme_stripe},  // after nvme_devices
     {"nvme_device_model", parse_nvme_device_model},
+    {"nvme_queue_depth", parse_nvme_queue_depth},
+    {"nvme_tail_control", parse_nvme_tail_control},
+    {"nvme_calibrate", parse_nvme_calibrate},
+    {"nvme_merge_size", parse_nvme_merge_size},
+    {"nvme_max_cmd_size", parse_nvme_max_cmd_size},  // after nvme_merge_size
     // { "mem_channel", parse_mem_channel},
     {"batch", parse_batch},
     {"loader_path", parse_loader_path},
@@ -465,12 +477,194 @@ static int parse_ns_sizes(void) {
     return 0;
 }
 
+static int add_stripe_member(const char *dev) {
+    int ret, i;
+    struct pci_addr addr;
+
+    ret = pci_str_to_addr(dev, &addr);
+    if (ret) {
+        log_err("cfg: invalid stripe member %s\n", dev);
+        return ret;
+    }
+    for (i = 0; i < CFG.num_nvmedev; ++i) {
+        if (!memcmp(&CFG.nvmedev[i], &addr, sizeof(struct pci_addr)))
+            break;
+    }
+    if (i == CFG.num_nvmedev) {
+        log_err("cfg: stripe member %s is not in nvme_devices\n", dev);
+        return -EINVAL;
+    }
+    for (i = 0; i < CFG.num_stripe_members; ++i) {
+        if (!memcmp(&CFG.stripe_members[i], &addr, sizeof(struct pci_addr)))
+            return -EINVAL;
+    }
+    if (CFG.num_stripe_members >= CFG_MAX_NVMEDEV)
+        return -E2BIG;
+    CFG.stripe_members[CFG.num_stripe_members++] = addr;
+    return 0;
+}
+
+static int parse_nvme_stripe(void) {
+    const config_setting_t *members = NULL;
+    const char *dev = NULL;
+    int i, ret;
+    long long unit = 0;
+
+    CFG.stripe_unit = 0;
+    CFG.num_stripe_members = 0;
+    if (!config_lookup_int64(&cfg, "nvme_stripe_unit", &unit) || !unit)
+        return 0;
+    if (unit < 4096 || (unit % 4096) != 0) {
+        log_err("cfg: nvme_stripe_unit must be a multiple of 4KB\n");
+        return -EINVAL;
+    }
+    CFG.stripe_unit = (unsigned long)unit;
+
+    members = config_lookup(&cfg, "nvme_stripe_members");
+    if (!members) {
+        // default: stripe across all nvme_devices in configuration order
+        for (i = 0; i < CFG.num_nvmedev; ++i)
+            CFG.stripe_members[i] = CFG.nvmedev[i];
+        CFG.num_stripe_members = CFG.num_nvmedev;
+    } else if ((dev = config_setting_get_string(members))) {
+        ret = add_stripe_member(dev);
+        if (ret)
+            return ret;
+    } else {
+        for (i = 0; i < config_setting_length(members); ++i) {
+            dev = config_setting_get_string_elem(members, i);
+            ret = add_stripe_member(dev);
+            if (ret)
+                return ret;
+        }
+    }
+    if (CFG.num_stripe_members == 0) {
+        log_err("cfg: nvme_stripe_unit set but no stripe members\n");
+        return -EINVAL;
+    }
+
+    log_info("NVMe striped volume: %d members, stripe unit %lu bytes\n",
+             CFG.num_stripe_members, CFG.stripe_unit);
+    return 0;
+}
+
 int compare_lat_tokenrate(const void *a, const void *b) {
     struct lat_tokenrate_pair *a_pair = (struct lat_tokenrate_pair *)a;
     struct lat_tokenrate_pair *b_pair = (struct lat_tokenrate_pair *)b;
     return (a_pair->p95_tail_latency - b_pair->p95_tail_latency);
 }
 
+static int compare_cost_point(const void *a, const void *b) {
+    const struct nvme_cost_point *x = a, *y = b;
+
+    return (x->size > y->size) - (x->size < y->size);
+}
+
+/*
+ * parse_nvme_cost_table - parses the optional cost_table of a devmodel file
+ */
+static int parse_nvme_cost_table(const config_setting_t *table) {
+    const config_setting_t *entry;
+    int i, size, read, write;
+
+    nvme_cost_table_size = 0;
+    if (!table)
+        return 0;
+    if (config_setting_length(table) > NVME_COST_MAX_POINTS) {
+        log_err("cfg: cost_table has more than %d entries\n",
+                NVME_COST_MAX_POINTS);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < config_setting_length(table); i++) {
+        entry = config_setting_get_elem(table, i);
+        if (!config_setting_lookup_int(entry, "size", &size) ||
+            !config_setting_lookup_int(entry, "read", &read) ||
+            !config_setting_lookup_int(entry, "write", &write) ||
+            size <= 0 || read <= 0 || write <= 0) {
+            log_err("cfg: cost_table entry %d needs positive size, read "
+                    "and write\n", i);
+            return -EINVAL;
+        }
+        nvme_cost_table[i].size = size;
+        nvme_cost_table[i].read = read;
+        nvme_cost_table[i].write = write;
+    }
+    nvme_cost_table_size = i;
+    qsort(nvme_cost_table, nvme_cost_table_size, sizeof(nvme_cost_table[0]),
+          compare_cost_point);
+    log_info("NVMe request costs: %d size classes from the cost_table\n",
+             nvme_cost_table_size);
+    return 0;
+}
+
+static void parse_emu_op_latency(const config_setting_t *op,
+                                 struct emu_op_latency *lat) {
+    int val;
+
+    if (!op)
+        return;
+    if (config_setting_lookup_int(op, "latency_us", &val))
+        lat->latency_us = val;
+    if (config_setting_lookup_int(op, "per_4KB_us", &val))
+        lat->per_4KB_us = val;
+    if (config_setting_lookup_int(op, "jitter_us", &val))
+        lat->jitter_us = val;
+    if (config_setting_lookup_int(op, "tail_latency_us", &val))
+        lat->tail_latency_us = val;
+    config_setting_lookup_float(op, "tail_pct", &lat->tail_pct);
+}
+
+/**
+ * parse_nvme_emulation - parses the emulation section of a devmodel file
+ * @emu: the "emulation" group, fields missing from it keep their defaults
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+static int parse_nvme_emulation(const config_setting_t *emu) {
+    long long capacity_GB = 256;
+    int val;
+
+    emu_model.read = (struct emu_op_latency){80, 10, 20, 0.0, 0};
+    emu_model.write = (struct emu_op_latency){20, 10, 10, 0.0, 0};
+    emu_model.channels = 32;
+    emu_model.rw_interference_pct = 0;
+    emu_model.gc_interval_writes = 0;
+    emu_model.gc_pause_us = 0;
+    emu_model.sector_size = 512;
+
+    if (!emu) {
+        log_info("WARNING: no emulation section, using default emulated device.\n");
+    } else {
+        parse_emu_op_latency(config_setting_get_member(emu, "read"), &emu_model.read);
+        parse_emu_op_latency(config_setting_get_member(emu, "write"), &emu_model.write);
+        config_setting_lookup_int(emu, "channels", &emu_model.channels);
+        if (config_setting_lookup_int(emu, "rw_interference_pct", &val))
+            emu_model.rw_interference_pct = val;
+        if (config_setting_lookup_int(emu, "gc_interval_writes", &val))
+            emu_model.gc_interval_writes = val;
+        if (config_setting_lookup_int(emu, "gc_pause_us", &val))
+            emu_model.gc_pause_us = val;
+        if (config_setting_lookup_int(emu, "sector_size", &val))
+            emu_model.sector_size = val;
+        config_setting_lookup_int64(emu, "capacity_GB", &capacity_GB);
+    }
+
+    if (emu_model.channels <= 0 || emu_model.sector_size == 0 ||
+        4096 % emu_model.sector_size || capacity_GB <= 0) {
+        log_err("cfg: invalid emulated NVMe device parameters\n");
+        return -EINVAL;
+    }
+    emu_model.ns_size = (unsigned long)capacity_GB << 30;
+
+    log_info("NVMe emulation: rd %uus wr %uus, %d channels, rw interference %u%%, "
+             "GC %uus every %u writes\n",
+             emu_model.read.latency_us, emu_model.write.latency_us,
+             emu_model.channels, emu_model.rw_interference_pct,
+             emu_model.gc_pause_us, emu_model.gc_interval_writes);
+    return 0;
+}
+
 static int parse_nvme_device_model(void) {
     config_setting_t *devs = NULL;
     const char *dev_model_ = NULL;
@@ -501,7 +695,12 @@ static int parse_nvme_device_model(void) {
         return 0;
     }
 
-    nvme_dev_model = FLASH_DEV_MODEL;
+    if (!strncmp(dev_model_, "emulate:", 8)) {
+        nvme_dev_model = EMULATED_FLASH;
+        dev_model_ += 8;
+    } else {
+        nvme_dev_model = FLASH_DEV_MODEL;
+    }
 
     strncpy(devmodel_file, dev_model_, sizeof(devmodel_file));
     devmodel_file[sizeof(devmodel_file) - 1] = '\0';
@@ -518,6 +717,10 @@ static int parse_nvme_device_model(void) {
     }
 
     log_info("NVMe device model: %s\n", devmodel_file);
+    if (nvme_dev_model == EMULATED_FLASH &&
+        parse_nvme_emulation(config_lookup(&cfg_devmodel, "emulation")))
+        return -EINVAL;
+
     // parse device request costs
     read_cost = config_lookup(&cfg_devmodel, "read_cost_4KB");
     write_cost = config_lookup(&cfg_devmodel, "write_cost_4KB");
@@ -535,6 +738,9 @@ static int parse_nvme_device_model(void) {
         NVME_WRITE_COST = 2000;  // default write cost
     }
 
+    if (parse_nvme_cost_table(config_lookup(&cfg_devmodel, "cost_table")))
+        return -EINVAL;
+
     // parse token limits and store in memory for lookup during runtime
     if (config_setting_get_int(max_token_rate)) {
         MAX_DEV_TOKEN_RATE = config_setting_get_int(max_token_rate);
@@ -577,6 +783,89 @@ static int parse_nvme_device_model(void) {
     return 0;
 }
 
+static int parse_nvme_queue_depth(void) {
+    int depth = 0;
+
+    config_lookup_int(&cfg, "nvme_queue_depth", &depth);
+    if (depth < 0)
+        return -EINVAL;
+    CFG.nvme_queue_depth = depth;
+    if (depth)
+        log_info("NVMe queue depth: %d\n", depth);
+    return 0;
+}
+
+static int parse_nvme_tail_control(void) {
+    const char *mode = NULL;
+
+    CFG.nvme_tail_pct = 0;
+    config_lookup_string(&cfg, "nvme_tail_control", &mode);
+    if (!mode || !strcmp(mode, "off"))
+        return 0;
+    if (!strcmp(mode, "p95")) {
+        CFG.nvme_tail_pct = 95;
+    } else if (!strcmp(mode, "p99")) {
+        CFG.nvme_tail_pct = 99;
+    } else {
+        log_err("cfg: nvme_tail_control must be \"off\", \"p95\" or \"p99\"\n");
+        return -EINVAL;
+    }
+    log_info("NVMe tail latency control: p%d\n", CFG.nvme_tail_pct);
+    return 0;
+}
+
+static int parse_nvme_calibrate(void) {
+    const char *path = NULL;
+
+    CFG.nvme_calibrate[0] = '\0';
+    config_lookup_string(&cfg, "nvme_calibrate", &path);
+    if (!path)
+        return 0;
+    if (nvme_dev_model == FAKE_FLASH || nvme_dev_model == EMULATED_FLASH) {
+        log_err("cfg: nvme_calibrate needs a real device\n");
+        return -EINVAL;
+    }
+    strncpy(CFG.nvme_calibrate, path, sizeof(CFG.nvme_calibrate));
+    CFG.nvme_calibrate[sizeof(CFG.nvme_calibrate) - 1] = '\0';
+    log_info("NVMe calibration: writing device model to %s\n",
+             CFG.nvme_calibrate);
+    return 0;
+}
+
+#define DEFAULT_NVME_MERGE_SIZE (128 * 1024)
+
+static int parse_nvme_merge_size(void) {
+    long long size = DEFAULT_NVME_MERGE_SIZE;
+
+    config_lookup_int64(&cfg, "nvme_merge_size", &size);
+    if (size < 0)
+        return -EINVAL;
+    CFG.nvme_merge_size = (unsigned long)size;
+    if (size != DEFAULT_NVME_MERGE_SIZE)
+        log_info("NVMe request merging: up to %lld bytes\n", size);
+    return 0;
+}
+
+#define DEFAULT_NVME_MAX_CMD_SIZE (128 * 1024)
+
+static int parse_nvme_max_cmd_size(void) {
+    long long size = DEFAULT_NVME_MAX_CMD_SIZE;
+
+    config_lookup_int64(&cfg, "nvme_max_cmd_size", &size);
+    if (size < 0 || size % 4096) {
+        log_err("cfg: nvme_max_cmd_size must be a multiple of 4KB\n");
+        return -EINVAL;
+    }
+    CFG.nvme_max_cmd_size = (unsigned long)size;
+    if (size != DEFAULT_NVME_MAX_CMD_SIZE)
+        log_info("NVMe max command size: %lld bytes\n", size);
+
+    // merged commands must not grow past the chunk size again
+    if (size && CFG.nvme_merge_size > CFG.nvme_max_cmd_size)
+        CFG.nvme_merge_size = CFG.nvme_max_cmd_size;
+    return 0;
+}
+
 static int parse_scheduler_mode(void) {
     const config_setting_t *sched = NULL;
     const char *sched_mode = NULL;
@@ -593,8 +882,12 @@ static int parse_scheduler_mode(void) {
             nvme_sched_flag = true;
             log_info("I/O Scheduler: ON\n");
         } else if (!strcmp(sched_mode, "off")) {
-            nvme_dev_model = DEFAULT_FLASH;
             nvme_sched_flag = false;
+            if (nvme_dev_model == EMULATED_FLASH) {
+                log_info("I/O Scheduler: OFF (and using EMULATED FLASH)\n");
+                return 0;
+            }
+            nvme_dev_model = DEFAULT_FLASH;
             log_info("I/O Scheduler: OFF (and using DEFAULT FLASH)\n");
         } else {
             log_info("Default: scheduler on\n");
@@ -75,6 +75,8 @@ RTE_DEFINE_PER_LCORE(kstats_accumulate, _kstats_accumulate);
 RTE_DEFINE_PER_LCORE(int, _kstats_packets);
 RTE_DEFINE_PER_LCORE(int, _kstats_batch_histogram[KSTATS_BATCH_HISTOGRAM_SIZE]);
 RTE_DEFINE_PER_LCORE(int, _kstats_backlog_histogram[KSTATS_BACKLOG_HISTOGRAM_SIZE]);
+RTE_DEFINE_PER_LCORE(int, _kstats_nvme_cmds);
+RTE_DEFINE_PER_LCORE(int, _kstats_nvme_doorbells);
 RTE_DEFINE_PER_LCORE(int, llc_load_misses_fd);
 RTE_DEFINE_PER_LCORE(int, hw_instructions_fd);
 
@@ -184,13 +186,18 @@ static long long read_perf_event(int fd) {
 static void kstats_print(struct timer *t, struct eth_fg *none) {
     uint64_t total_cycles = (uint64_t)cycles_per_us * KSTATS_INTERVAL;
     char batch_histogram[2048], backlog_histogram[2048];
-    int avg_batch, avg_backlog;
+    int avg_batch, avg_backlog, avg_nvme_doorbell;
 
     histogram_to_str(percpu_get(_kstats_batch_histogram), KSTATS_BATCH_HISTOGRAM_SIZE, batch_histogram, &avg_batch);
     histogram_to_str(percpu_get(_kstats_backlog_histogram), KSTATS_BACKLOG_HISTOGRAM_SIZE, backlog_histogram, &avg_backlog);
 
+    if (percpu_get(_kstats_nvme_doorbells))
+        avg_nvme_doorbell = percpu_get(_kstats_nvme_cmds) / percpu_get(_kstats_nvme_doorbells);
+    else
+        avg_nvme_doorbell = -1;
+
     kstats *ks = &(percpu_get(_kstats));
-    log_info("--- BEGIN KSTATS --- %ld%% idle, %ld%% user, %ld%% sys, non idle cycles=%lld, HW instructions=%lld, LLC load misses=%lld (%d pkts, avg batch=%d [%s], avg backlog=%d [%s])\n",
+    log_info("--- BEGIN KSTATS --- %ld%% idle, %ld%% user, %ld%% sys, non idle cycles=%lld, HW instructions=%lld, LLC load misses=%lld (%d pkts, avg batch=%d [%s], avg backlog=%d [%s], %d nvme cmds, avg cmds/doorbell=%d)\n",
              ks->idle.tot_lat * 100 / total_cycles,
              ks->user.tot_lat * 100 / total_cycles,
              max(0, (int64_t)(total_cycles - ks->idle.tot_lat - ks->user.tot_lat)) * 100 / total_cycles,
@@ -201,7 +208,9 @@ static void kstats_print(struct timer *t, struct eth_fg *none) {
              avg_batch,
              batch_histogram,
              avg_backlog,
-             backlog_histogram);
+             backlog_histogram,
+             percpu_get(_kstats_nvme_cmds),
+             avg_nvme_doorbell);
 #undef DEF_KSTATS
 #define DEF_KSTATS(_c) kstats_printone(&ks->_c, #_c, total_cycles);
 #include <ix/kstatvectors.h>
@@ -212,6 +221,8 @@ static void kstats_print(struct timer *t, struct eth_fg *none) {
     bzero(percpu_get(_kstats_batch_histogram), sizeof(*percpu_get(_kstats_batch_histogram)) * KSTATS_BATCH_HISTOGRAM_SIZE);
     bzero(percpu_get(_kstats_backlog_histogram), sizeof(*percpu_get(_kstats_backlog_histogram)) * KSTATS_BACKLOG_HISTOGRAM_SIZE);
     percpu_get(_kstats_packets) = 0;
+    percpu_get(_kstats_nvme_cmds) = 0;
+    percpu_get(_kstats_nvme_doorbells) = 0;
 
     timer_add(&percpu_get(_kstats_timer), NULL, KSTATS_INTERVAL);
 }
@@ -103,7 +103,8 @@ static bsysfn_t bsys_tbl[] = {
     (bsysfn_t)bsys_nvme_open,
     (bsysfn_t)bsys_nvme_close,
     (bsysfn_t)bsys_nvme_register_flow,
-    (bsysfn_t)bsys_nvme_unregister_flow};
+    (bsysfn_t)bsys_nvme_unregister_flow,
+    (bsysfn_t)bsys_nvme_writev_sg};
 
 //
 // TODO: Get rid of these eventually
@@ -75,6 +75,7 @@ enum nvme_dev_models {
     DEFAULT_FLASH,    // generic device with no token limit
     FAKE_FLASH,       // no flash: don't schedule nvme requests on device, directly call nvme completion event
     FLASH_DEV_MODEL,  // flash with request cost model and token limits specified in config input file
+    EMULATED_FLASH,   // no flash: FLASH_DEV_MODEL costs, completions delayed by the emulation model in the same file
 };
 
 struct cfg_ip_addr {
@@ -99,6 +100,16 @@ struct cfg_parameters {
     struct pci_addr nvmedev[CFG_MAX_NVMEDEV];
     unsigned long ns_sizes[CFG_MAX_NVMEDEV];
 
+    unsigned long stripe_unit;  // in bytes, 0 if not striping
+    int num_stripe_members;
+    struct pci_addr stripe_members[CFG_MAX_NVMEDEV];
+
+    unsigned int nvme_queue_depth;  // per qpair, 0 for the default
+    int nvme_tail_pct;              // tail percentile to control, 0 if off
+    char nvme_calibrate[256];       // devmodel file to generate, "" if off
+    unsigned long nvme_merge_size;  // max bytes of a merged command, 0 if off
+    unsigned long nvme_max_cmd_size;  // larger requests are chunked, 0 if off
+
     int num_ports;
     uint16_t ports[CFG_MAX_PORTS];
 
@@ -123,6 +134,38 @@ struct lat_tokenrate_pair {
 struct lat_tokenrate_pair dev_model[128];
 int dev_model_size;
 
+// request cost by size from the devmodel cost_table, sorted by size
+struct nvme_cost_point {
+    uint32_t size;  // request size in bytes
+    uint32_t read;  // tokens
+    uint32_t write;
+};
+
+#define NVME_COST_MAX_POINTS 32
+struct nvme_cost_point nvme_cost_table[NVME_COST_MAX_POINTS];
+int nvme_cost_table_size;
+
+struct emu_op_latency {
+    uint32_t latency_us;       // service time of a 4KB request
+    uint32_t per_4KB_us;       // added for every further 4KB
+    uint32_t jitter_us;        // uniform jitter in [0, jitter_us)
+    double tail_pct;           // percentage of requests served in tail_latency_us
+    uint32_t tail_latency_us;
+};
+
+struct emu_dev_model {
+    struct emu_op_latency read;
+    struct emu_op_latency write;
+    int channels;                  // internal parallelism of the device
+    uint32_t rw_interference_pct;  // read slowdown while writes are in flight
+    uint32_t gc_interval_writes;   // GC pause every N 4KB writes, 0 to disable
+    uint32_t gc_pause_us;
+    unsigned long ns_size;         // in bytes
+    unsigned long sector_size;
+};
+
+struct emu_dev_model emu_model;
+
 extern int cfg_init(int argc, char *argv[], int *args_parsed);
 
 int cores_active;
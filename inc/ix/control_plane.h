@@ -56,6 +56,7 @@
  * control_plane.h - control plane definitions
  */
 
+#include <ix/cfg.h>
 #include <ix/compiler.h>
 #include <ix/ethfg.h>
 #include <rte_per_lcore.h>
@@ -70,6 +71,15 @@ struct cpu_metrics {
     double idle[3];
 } __aligned(64);
 
+struct nvme_metrics {
+    uint64_t token_rate;       // current global token rate (tokens/s)
+    uint32_t target_lat_us;    // strictest latency SLO, 0 if none
+    uint32_t tail_pct;         // controlled percentile, 0 if control is off
+    uint32_t nr_devices;
+    uint32_t p95_lat_us[CFG_MAX_NVMEDEV];  // sliding window read latency
+    uint32_t p99_lat_us[CFG_MAX_NVMEDEV];
+} __aligned(64);
+
 struct flow_group_metrics {
     int cpu;
 } __aligned(64);
@@ -134,6 +144,7 @@ extern volatile struct cp_shmem {
         long ts_first_pkt_at_target;
         long ts_last_pkt_at_target;
     } scratchpad[1024];
+    struct nvme_metrics nvme;
 } * cp_shmem;
 
 #define SCRATCHPAD (&cp_shmem->scratchpad[cp_shmem->scratchpad_idx])
@@ -89,6 +89,8 @@ RTE_DELCARE_PER_LCORE(kstats_accumulate, _kstats_accumulate);
 RTE_DELCARE_PER_LCORE(int, _kstats_packets);
 RTE_DELCARE_PER_LCORE(int, _kstats_batch_histogram[]);
 RTE_DELCARE_PER_LCORE(int, _kstats_backlog_histogram[]);
+RTE_DELCARE_PER_LCORE(int, _kstats_nvme_cmds);
+RTE_DELCARE_PER_LCORE(int, _kstats_nvme_doorbells);
 
 #define KSTATS_BATCH_HISTOGRAM_SIZE 512
 #define KSTATS_BACKLOG_HISTOGRAM_SIZE 512
@@ -118,6 +120,11 @@ static inline void kstats_backlog_inc(int count) {
     percpu_get(_kstats_backlog_histogram)[count]++;
 }
 
+static inline void kstats_nvme_doorbell(int cmds) {
+    percpu_get(_kstats_nvme_cmds) += cmds;
+    percpu_get(_kstats_nvme_doorbells)++;
+}
+
 #define KSTATS_PUSH(TYPE, _save) \
     kstats_enter(&(percpu_get(_kstats)).TYPE, _save)
 #define KSTATS_VECTOR(TYPE) \
@@ -131,6 +138,8 @@ static inline void kstats_backlog_inc(int count) {
     kstats_batch_inc(_count)
 #define KSTATS_BACKLOG_INC(_count) \
     kstats_backlog_inc(_count)
+#define KSTATS_NVME_DOORBELL(_cmds) \
+    kstats_nvme_doorbell(_cmds)
 
 extern int kstats_init_cpu(void);
 
@@ -143,5 +152,6 @@ extern int kstats_init_cpu(void);
 #define KSTATS_PACKETS_INC(_count)
 #define KSTATS_BATCH_INC(_count)
 #define KSTATS_BACKLOG_INC(_count)
+#define KSTATS_NVME_DOORBELL(_cmds)
 
 #endif /* ENABLE_KSTATS */
@@ -161,6 +161,21 @@ static inline void *mempool_alloc(struct mempool *m) {
         return ptr;
 }
 
+/**
+ * mempool_alloc_bulk - allocates several elements from a memory pool
+ * @m: the memory pool
+ * @ptrs: filled with the allocated elements
+ * @n: the number of elements
+ *
+ * Either all @n elements are allocated or none.
+ *
+ * Returns 0 if successful, otherwise a negative error code.
+ */
+static inline int mempool_alloc_bulk(struct mempool *m, void **ptrs,
+                                     unsigned int n) {
+    return rte_mempool_get_bulk(m->datastore->pool, ptrs, n);
+}
+
 /**
  * mempool_free - frees an element back in to a memory pool
  * @m: the memory pool
@@ -174,6 +189,17 @@ static inline void mempool_free(struct mempool *m, void *ptr) {
     rte_mempool_put(m->datastore->pool, ptr);
 }
 
+/**
+ * mempool_free_bulk - frees several elements back in to a memory pool
+ * @m: the memory pool
+ * @ptrs: the elements
+ * @n: the number of elements
+ */
+static inline void mempool_free_bulk(struct mempool *m, void **ptrs,
+                                     unsigned int n) {
+    rte_mempool_put_bulk(m->datastore->pool, ptrs, n);
+}
+
 static inline void *mempool_idx_to_ptr(struct mempool *m, uint32_t idx, int elem_len) {
     void *p;
     assert(idx < m->nr_elems);
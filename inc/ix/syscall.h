@@ -220,6 +220,7 @@ enum {
     KSYS_NVME_CLOSE,
     KSYS_NVME_REGISTER_FLOW,
     KSYS_NVME_UNREGISTER_FLOW,
+    KSYS_NVME_WRITEV_SG,
     KSYS_NR,
 };
 
@@ -433,21 +434,55 @@ ksys_nvme_readv(struct bsys_desc *d, hqu_t fg_handle, void **sgls, int num_sgls,
                    lba, lba_count, cookie);
 }
 
+/* the most entries a ksys_nvme_writev_sg() list may have */
+#define NVME_MAX_SG_ENTRIES 128
+
+/**
+ * ksys_nvme_writev_sg - gather write of byte-granular buffers to an nvme queue
+ * @d: the syscal descriptor to program
+ * @fg_handle: the flow group handle
+ * @ents: the buffers, e.g. received packet payloads
+ * @nrents: number of entries, at most NVME_MAX_SG_ENTRIES
+ * @lba: the logical block address of the write
+ * @lba_count: size of the write in logical blocks
+ * @cookie: a user-level tag for the request
+ *
+ * Unlike ksys_nvme_writev(), entries need not be page sized. Only valid if
+ * the queue was opened with NVME_OPEN_SG_ENTRIES; with NVME_OPEN_SG_DWORD
+ * every entry must also start and end on a 4-byte boundary.
+ */
+static inline void
+ksys_nvme_writev_sg(struct bsys_desc *d, hqu_t fg_handle,
+                    struct sg_entry *ents, int nrents, unsigned long lba,
+                    int lba_count, unsigned long cookie) {
+    BSYS_DESC_6ARG(d, KSYS_NVME_WRITEV_SG, fg_handle, ents, nrents,
+                   lba, lba_count, cookie);
+}
+
+/*
+ * A flow group id with NVME_FG_TENANT set names a tenant rather than a
+ * connection: its connections share one SLO and token budget across all
+ * cores they are registered on.
+ */
+#define NVME_FG_TENANT (1L << 48)
+
 /**
  * ksys_nvme_register_flow - registers an nvme flow
  * @d: the syscal descriptor to program
- * @flow_group_id: flow group's id
+ * @flow_group_id: flow group's id, NVME_FG_TENANT | tenant id if shared
  * @ns_id: namespace id
  * @latency_us_SLO: latency SLO (0 if not latency critical, ie if best-effort)
  * @IOPS_SLO: IOPS SLO (0 if not latency critical)
  * @rw_ratio_SLO: read write ratio corresponding to SLO above
+ * @be_weight: share of best-effort tokens relative to other best-effort
+ *             tenants (0 for the default of 1, ignored if latency critical)
  */
 static inline void
 ksys_nvme_register_flow(struct bsys_desc *d, long flow_group_id, unsigned long cookie,
                         unsigned int latency_us_SLO, unsigned long IOPS_SLO,
-                        int rw_ratio_SLO) {
-    BSYS_DESC_5ARG(d, KSYS_NVME_REGISTER_FLOW, flow_group_id, cookie,
-                   latency_us_SLO, IOPS_SLO, rw_ratio_SLO);
+                        int rw_ratio_SLO, unsigned int be_weight) {
+    BSYS_DESC_6ARG(d, KSYS_NVME_REGISTER_FLOW, flow_group_id, cookie,
+                   latency_us_SLO, IOPS_SLO, rw_ratio_SLO, be_weight);
 }
 
 /* ksys_nvme_unregister_flow - unregisters an nvme flow
@@ -621,17 +656,24 @@ usys_nvme_response(unsigned long cookie, void *buf, long ret) {
     BSYS_DESC_3ARG(d, USYS_NVME_RESPONSE, cookie, buf, ret);
 }
 
+/* flags of an opened nvme queue */
+#define NVME_OPEN_SG_ENTRIES 0x1 /* takes ksys_nvme_writev_sg() */
+#define NVME_OPEN_SG_DWORD 0x2   /* ... with 4-byte aligned entries only */
+
 /**
  * usys_nvme_opened - indicates that an attempt to open a queue to a
  * device has completed - not necessarily successful 
  * @handle: the nvme queue handle
  * @size: the size of the opened namespace
  * @sector size: the sector size of the opened namespace
+ * @flags: NVME_OPEN_* capabilities of the queue
  */
 static inline void
-usys_nvme_opened(hqu_t handle, long ns_size, long ns_sector_size) {
+usys_nvme_opened(hqu_t handle, long ns_size, long ns_sector_size,
+                 long flags) {
     struct bsys_desc *d = usys_next();
-    BSYS_DESC_3ARG(d, USYS_NVME_OPENED, handle, ns_size, ns_sector_size);
+    BSYS_DESC_4ARG(d, USYS_NVME_OPENED, handle, ns_size, ns_sector_size,
+                   flags);
 }
 
 /**
@@ -718,7 +760,7 @@ extern long bsys_nvme_open(long dev_id, long ns_id);
 extern long bsys_nvme_close(long dev_id, long ns_id, hqu_t handle);
 extern long bsys_nvme_register_flow(long flow_group_id, unsigned long cookie,
                                     unsigned int latency_us_SLO, unsigned long IOPS_SLO,
-                                    int rw_ratio_SLO);
+                                    int rw_ratio_SLO, unsigned int be_weight);
 extern long bsys_nvme_unregister_flow(long flow_group_id);
 extern long bsys_nvme_write(hqu_t priority, void *buf, unsigned long lba,
                             unsigned int lba_count, unsigned long cookie);
@@ -730,6 +772,10 @@ extern long bsys_nvme_writev(hqu_t fg_handle, void **sgls, int num_sgls,
 extern long bsys_nvme_readv(hqu_t fg_handle, void **sgls, int num_sgls,
                             unsigned long lba, unsigned int lba_count, unsigned long cookie);
 
+extern long bsys_nvme_writev_sg(hqu_t fg_handle, struct sg_entry *ents,
+                                int nrents, unsigned long lba,
+                                unsigned int lba_count, unsigned long cookie);
+
 /* Functions for dune commented
  struct dune_tf;
  extern void do_syscall(struct dune_tf *tf, uint64_t sysnr);
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2015-2017, Stanford University
+ *  
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  * Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * nvme_lat.h - log-linear latency histograms
+ *
+ * Latencies in us are binned with 8 sub-buckets per power of two, so a
+ * bucket bound is within 12.5% of the true value. Values below 8us get a
+ * bucket each.
+ */
+
+#pragma once
+
+#include <ix/stddef.h>
+#include <ix/types.h>
+
+#define NVME_LAT_SUB_BUCKETS 8
+#define NVME_LAT_BUCKETS 120  // last bucket starts at 64ms
+
+static inline int lat_bucket(unsigned long us) {
+    int e, idx;
+
+    if (us < NVME_LAT_SUB_BUCKETS) return us;
+    e = 63 - __builtin_clzl(us);
+    idx = (e - 2) * NVME_LAT_SUB_BUCKETS +
+          ((us >> (e - 3)) & (NVME_LAT_SUB_BUCKETS - 1));
+    return min(idx, NVME_LAT_BUCKETS - 1);
+}
+
+// largest latency in us that falls into bucket b
+static inline unsigned long lat_bucket_max_us(int b) {
+    int e = b / NVME_LAT_SUB_BUCKETS + 2;
+    unsigned long next = NVME_LAT_SUB_BUCKETS + b % NVME_LAT_SUB_BUCKETS + 1;
+
+    if (b < NVME_LAT_SUB_BUCKETS) return b;
+    return (next << (e - 3)) - 1;
+}
+
+/**
+ * lat_percentile - latency at percentile pct of a histogram
+ * @hist: NVME_LAT_BUCKETS counters
+ * @total: sum of @hist
+ * @pct: percentile (e.g. 95)
+ *
+ * Returns the upper bound of the bucket holding the percentile, in us.
+ */
+static inline unsigned long lat_percentile(const uint32_t *hist,
+                                           uint64_t total, int pct) {
+    uint64_t rank = (total * pct + 99) / 100, seen = 0;
+    int b;
+
+    for (b = 0; b < NVME_LAT_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= rank) return lat_bucket_max_us(b);
+    }
+    return lat_bucket_max_us(NVME_LAT_BUCKETS - 1);
+}
@@ -37,28 +37,65 @@
 
 #include <nvme/nvmedev.h>
 #include <ix/list.h>
-#define NVME_SW_QUEUE_SIZE (256*8)  
+
+/*
+ * Ring buffers start at 1 << NVME_SW_RING_MIN_ORDER entries and double on
+ * demand, up to 1 << NVME_SW_RING_MAX_ORDER; they come from per-core slabs,
+ * one per size class (see nvme_sw_queue_init_datastores).
+ */
+#define NVME_SW_RING_MIN_ORDER 4
+#define NVME_SW_RING_MAX_ORDER 11
+#define NVME_SW_RING_CLASSES (NVME_SW_RING_MAX_ORDER - NVME_SW_RING_MIN_ORDER + 1)
+
+struct nvme_sw_entry
+{
+	struct nvme_ctx* ctx;
+	int cost;				  // ctx->req_cost, so peeking doesn't touch ctx
+};
+
+/*
+ * Reads and writes of a tenant wait in separate rings so a costly write
+ * doesn't hold up the reads behind it. The rings are served by token cost:
+ * the next request comes from the ring that has been charged fewer tokens.
+ */
+struct nvme_sw_ring
+{
+	struct nvme_sw_entry* buf;	// NULL until the first push
+	unsigned int mask;		  // number of entries - 1
+	unsigned int order;
+    unsigned int head;       // head index (insert here), free running
+    unsigned int tail;       // tail index (remove from here), free running
+	unsigned long vtime;	  // tokens charged to this ring
+};
 
 struct nvme_sw_queue
 {
-    struct nvme_ctx* buf[NVME_SW_QUEUE_SIZE]; 
-	int count;				  // number of elements current in queue
-    unsigned int head;       // head index (insert here)
-    unsigned int tail;       // tail index (remove from here)
+	struct nvme_sw_ring ring[2];	// indexed by NVME_CMD_READ/WRITE
 	unsigned long total_token_demand;
 	unsigned long saved_tokens;
     long fg_handle;
 	long token_credit;
+	unsigned long token_frac;	// fraction of a token carried between rounds,
+								// in 1/NVME_SHARE_ONE for best-effort tenants
+	unsigned long token_increment;	// tokens earned in the current round
+	bool backlogged;		// best-effort only: on the round-robin ring
 	struct list_node list;
 };
 
 
 
+int nvme_sw_queue_init_datastores(void);
+int nvme_sw_queue_init_cpu(void);
+
 void nvme_sw_queue_init(struct nvme_sw_queue *q, long fg_handle);
+void nvme_sw_queue_fini(struct nvme_sw_queue *q);
 int nvme_sw_queue_push_back(struct nvme_sw_queue *q, struct nvme_ctx *ctx);
 int nvme_sw_queue_pop_front(struct nvme_sw_queue *q, struct nvme_ctx **ctx);
+int nvme_sw_queue_pop_earliest(struct nvme_sw_queue *q, struct nvme_ctx **ctx);
 int nvme_sw_queue_isempty(struct nvme_sw_queue *q);
+int nvme_sw_queue_reserve(struct nvme_sw_queue *q, int cmd, unsigned int n);
 int nvme_sw_queue_peak_head_cost(struct nvme_sw_queue *q);
+unsigned long nvme_sw_queue_head_deadline(struct nvme_sw_queue *q);
 unsigned long nvme_sw_queue_save_tokens(struct nvme_sw_queue *q, unsigned long tokens);
 unsigned long nvme_sw_queue_take_saved_tokens(struct nvme_sw_queue *q);
 
@@ -50,7 +50,10 @@
 
 #define NVME_MAX_COMPLETIONS 64
 
-#define MAX_NVME_FLOW_GROUPS 16384 //16
+#define MAX_NVME_FLOW_GROUPS 131072 //16
+#define NVME_MAX_BE_WEIGHT 1024
+#define NVME_SHARE_SHIFT 10
+#define NVME_SHARE_ONE (1UL << NVME_SHARE_SHIFT)
 DEFINE_BITMAP(ioq_bitmap, MAX_NUM_IO_QUEUES);
 DEFINE_BITMAP(nvme_fgs_bitmap, MAX_NVME_FLOW_GROUPS);
 RTE_DECLARE_PER_LCORE(struct spdk_nvme_qpair *, qpair);
@@ -63,8 +66,11 @@ struct nvme_ctx {
 		void * buf;
 		struct sgl_buf{
 			void **sgl;
+			struct sg_entry *ents;			//byte-granular buffers instead of sgl pages (writev_sg)
 			int num_sgls;
 			int current_sgl;
+			unsigned int offset;			//byte offset of the request into sgl[0]
+			unsigned int current_offset;	//byte offset into sgl[current_sgl]
 		} sgl_buf;
 	} user_buf;
 	// added for SW scheduling...
@@ -75,33 +81,71 @@ struct nvme_ctx {
 	int req_cost; 					//cost of request in tokens
 	// command arguments...
 	struct spdk_nvme_ns *ns;		//namespace
+	int qp_idx;						//qpair of the target device (stripe member)
 	void* paddr;					//physical addr of buffer to write/read to
 	unsigned long lba;				//logical block address
 	unsigned int lba_count;			//size of IO in logical blocks
 	const struct nvme_completion* completion;	//callback function handle
 	unsigned long time;
+	unsigned long deadline;			//latency-critical only: enqueue time + SLO, in cycles
+	// striped volume: a request crossing stripe units is split into children
+	struct nvme_ctx *parent;		//parent request (NULL if not a child)
+	int stripe_pending;				//children still outstanding (parent only)
+	// merged command: carries contiguous requests of one tenant
+	struct nvme_ctx *merge_head;	//first request carried (NULL if not merged)
+	struct nvme_ctx *merge_next;	//next request carried; SGL cursor of the command
+	// stolen by another core: completion handed back to the owner (tid)
+	struct nvme_ctx *remote_next;	//next completion on the owner's list
+	int remote_ret;					//completion status
+	// emulated flash (EMULATED_FLASH)
+	unsigned long emu_done;			//completion time in cycles
+	struct nvme_ctx *emu_next;		//next request on the same channel
+	struct list_node link;			//deferred list while the qpair is full
 };
 
 
+// an LC tenant in the heap of latency SLOs
+struct nvme_slo_node {
+	unsigned int latency_us_SLO;
+	int heap_idx;
+};
+
 struct nvme_flow_group {
-	int flow_group_id;				// flow group id (index in bitmap)
+	long flow_group_id;				// flow group id (index in bitmap)
 	//long ns_id; 					// namespace id
 	unsigned long cookie;			// cookie associated with connection context for user
 	unsigned int latency_us_SLO;	// latency SLO info (0 if best effort)
 	unsigned long IOPS_SLO;
 	int rw_ratio_SLO;
+	unsigned int be_weight;			// share of best-effort tokens (0 if latency critical)
 	unsigned long scaled_IOPS_limit; // calculated based on IOPS, rw_ratio and rw cost
-	double scaled_IOPuS_limit; 		
+	unsigned long token_rate_fp;	// LC token rate in fixed-point tokens per TSC cycle
 	bool latency_critical_flag;
 	struct nvme_sw_queue* nvme_swq;	// thread-local software queue for this flow group
 	unsigned int tid; 				// thread id 
 	int conn_ref_count;
+	// tenant with connections on several cores (NVME_FG_TENANT)
+	struct nvme_tenant *tenant;		// NULL if the flow group is the whole tenant
+	struct list_node tenant_link;	// on the core's shared_fgs list
+	unsigned long share;			// of the tenant's budget, in 1/NVME_SHARE_ONE
+	unsigned long demand;			// tokens enqueued since the last rebalance
+	unsigned long sched_weight;		// be_weight * share, what the core schedules by
+	struct nvme_slo_node slo_node;	// unless shared, then the tenant's
+	int hash_next;					// next slot in the hash chain, 0 ends it
 };
 
 struct nvme_tenant_mgmt {
-	struct list_head tenant_swq;
+	struct list_head lc_tenants;	// all latency-critical tenants
+	struct list_head be_backlog;	// best-effort tenants with queued requests, in round-robin order
+	struct nvme_sw_queue **lc_heap;	// LC tenants that can issue, by earliest head deadline
+	int lc_heap_cap;
+	int num_lc_tenants;
 	int num_tenants;
 	int num_best_effort_tenants;
+	int num_be_backlogged;
+	unsigned long be_weight;			// of all best-effort tenants, in sched_weight units
+	unsigned long be_backlog_weight;	// of the backlogged ones
+	struct list_head shared_fgs;	// flow groups of tenants shared with other cores
 };
 
 /*
@@ -120,6 +164,11 @@ RTE_DECLARE_PER_LCORE(struct nvme_tenant_mgmt, nvme_tenant_manager);
 extern struct nvme_ctx * alloc_local_nvme_ctx(void);
 extern void free_local_nvme_ctx(struct nvme_ctx *req);
 extern void nvme_process_completions(void); 
+struct spdk_nvme_cpl;
+extern void nvme_read_cb(void *ctx, const struct spdk_nvme_cpl *cpl);
+extern void nvme_write_cb(void *ctx, const struct spdk_nvme_cpl *cpl);
+struct spdk_nvme_ns;
+extern struct spdk_nvme_ns *nvme_qpair_ns(long ns_id);
 extern bool nvme_poll_completions(int max_completions);
 extern int nvme_schedule(void);
 extern int nvme_sched(void);
@@ -64,6 +64,8 @@ struct msg_header {
 typedef struct __attribute__((__packed__)) {
     uint16_t magic;
     uint16_t opcode;
+    // CMD_REG: best-effort weight (0 for the default) in the low 32 bits,
+    // tenant id in the high 32 bits (0 if the connection is its own tenant)
     void *req_handle;
     // IOPS_SLO
     unsigned long lba;
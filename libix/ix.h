@@ -74,7 +74,8 @@ struct ix_ops {
     void (*tcp_dead)(hid_t handle, unsigned long cookie);
     void (*nvme_written)(unsigned long cookie, long ret);
     void (*nvme_response)(unsigned long cookie, void *buf, long ret);
-    void (*nvme_opened)(hqu_t handle, unsigned long ns_size, unsigned long ns_sector_size);
+    void (*nvme_opened)(hqu_t handle, unsigned long ns_size, unsigned long ns_sector_size,
+                        unsigned long flags);
     void (*nvme_registered_flow)(long flow_group_id, unsigned long cookie, long ret);
     void (*nvme_unregistered_flow)(long flow_group_id, long ret);
     void (*timer_event)(unsigned long cookie);
@@ -203,6 +204,16 @@ static inline void ix_nvme_writev(hqu_t fg_handle, void **sgls,
                      lba, lba_count, cookie);
 }
 
+static inline void ix_nvme_writev_sg(hqu_t fg_handle, struct sg_entry *ents,
+                                     int nrents, unsigned long lba, unsigned int lba_count,
+                                     unsigned long cookie) {
+    if (karr->len >= karr->max_len)
+        ix_flush();
+
+    ksys_nvme_writev_sg(__bsys_arr_next(karr), fg_handle, ents, nrents,
+                        lba, lba_count, cookie);
+}
+
 extern void *ix_alloc_pages(int nrpages);
 extern void ix_free_pages(void *addr, int nrpages);
 
@@ -95,6 +95,21 @@ __ixev_recv_done(struct ixev_ctx *ctx, size_t len) {
     }
 }
 
+/*
+ * ixev_recv_consumed - the application is done with len more bytes
+ *
+ * The kernel frees receive buffers in stream order, so while data is held
+ * (see ixev_recv_hold()) nothing past the first hold is given back yet.
+ */
+static inline void ixev_recv_consumed(struct ixev_ctx *ctx, size_t len) {
+    ctx->recv_total += len;
+    if (ctx->rref_head)
+        return;
+
+    __ixev_recv_done(ctx, ctx->recv_total - ctx->recv_acked);
+    ctx->recv_acked = ctx->recv_total;
+}
+
 static inline void
 __ixev_sendv(struct ixev_ctx *ctx, struct sg_entry *ents, unsigned int nrents) {
     __ixev_check_generation(ctx);
@@ -252,7 +267,8 @@ static void ixev_nvme_response(unsigned long cookie, void *buf, long ret) {
     }
 }
 
-static void ixev_nvme_opened(hqu_t handle, unsigned long ns_size, unsigned long ns_sector_size) {
+static void ixev_nvme_opened(hqu_t handle, unsigned long ns_size, unsigned long ns_sector_size,
+                             unsigned long flags) {
     if (ns_size == 0) {
         printf("Error: Namespace does not exist or has zero size\n");
         return;
@@ -260,7 +276,7 @@ static void ixev_nvme_opened(hqu_t handle, unsigned long ns_size, unsigned long
 
     printf("ixev: opened nvme handle %lu\n", handle);
 
-    ixev_nvme_global_ops.opened(handle, ns_size, ns_sector_size);
+    ixev_nvme_global_ops.opened(handle, ns_size, ns_sector_size, flags);
 }
 
 static void ixev_nvme_registered_flow(long fg_handle, unsigned long cookie, long ret) {
@@ -345,7 +361,7 @@ ssize_t ixev_recv(struct ixev_ctx *ctx, void *buf, size_t len) {
     if (!pos)
         return -EAGAIN;
 
-    __ixev_recv_done(ctx, pos);
+    ixev_recv_consumed(ctx, pos);
     return pos;
 }
 
@@ -382,10 +398,114 @@ void *ixev_recv_zc(struct ixev_ctx *ctx, size_t len) {
     if (!ent->len)
         ctx->recv_head++;
 
-    __ixev_recv_done(ctx, len);
+    ixev_recv_consumed(ctx, len);
     return buf;
 }
 
+/*
+ * ixev_recv_peek - look at received data without consuming it
+ * @ctx: the context
+ * @len: set to the number of bytes available at the returned address
+ *
+ * Only the data of the first receive buffer is returned, so a caller that
+ * needs more can fall back to ixev_recv(). The data is consumed with
+ * ixev_recv_zc() or ixev_recv(), and the same rules as for the buffer of
+ * ixev_recv_zc() apply meanwhile.
+ *
+ * Returns a pointer to the data, or NULL if none is available.
+ */
+void *ixev_recv_peek(struct ixev_ctx *ctx, size_t *len) {
+    struct sg_entry *ent;
+
+    if (ctx->is_dead || ctx->recv_head == ctx->recv_tail)
+        return NULL;
+
+    ent = &ctx->recv[ctx->recv_head & (IXEV_RECV_DEPTH - 1)];
+    *len = ent->len;
+    return ent->base;
+}
+
+/**
+ * ixev_recv_hold - read an exact amount of data without copying, and keep
+ * the buffers until released
+ * @ctx: the context
+ * @len: the length to read
+ * @ents: filled with the buffers holding the data
+ * @nrents: the capacity of @ents
+ * @ref: the hold, to pass to ixev_recv_release()
+ *
+ * Unlike ixev_recv_zc(), the buffers stay valid after the caller returns
+ * and may be spread over several packets, e.g. to hand them to a device.
+ * Receive buffers are given back to the kernel in stream order, so later
+ * data, whether copied or held, is only given back once the hold is
+ * released, and the receive window shrinks meanwhile. The caller must
+ * bound the data it holds below the window.
+ *
+ * Returns the number of entries filled, -EAGAIN if less than @len bytes
+ * are available, or -ENOBUFS if they are spread over more than @nrents
+ * buffers. The data can then still be read with ixev_recv().
+ */
+int ixev_recv_hold(struct ixev_ctx *ctx, size_t len, struct sg_entry *ents,
+                   int nrents, struct ixev_recv_ref *ref) {
+    uint16_t head = ctx->recv_head;
+    size_t pos = 0;
+    int n = 0;
+
+    if (ctx->is_dead)
+        return -EAGAIN;
+
+    for (; pos < len && n < nrents && head != ctx->recv_tail; head++, n++)
+        pos += ctx->recv[head & (IXEV_RECV_DEPTH - 1)].len;
+    if (pos < len)
+        return n == nrents ? -ENOBUFS : -EAGAIN;
+
+    for (n = 0, pos = 0; pos < len; n++) {
+        struct sg_entry *ent =
+            &ctx->recv[ctx->recv_head & (IXEV_RECV_DEPTH - 1)];
+
+        ents[n].base = ent->base;
+        ents[n].len = min(ent->len, len - pos);
+        pos += ents[n].len;
+        ent->base = (char *)ent->base + ents[n].len;
+        ent->len -= ents[n].len;
+        if (!ent->len)
+            ctx->recv_head++;
+    }
+
+    ref->recv_pos = ctx->recv_total;
+    ref->released = false;
+    ref->next = NULL;
+    if (!ctx->rref_head)
+        ctx->rref_head = ref;
+    else
+        ctx->rref_tail->next = ref;
+    ctx->rref_tail = ref;
+
+    ctx->recv_total += len;
+    return n;
+}
+
+/**
+ * ixev_recv_release - done with data taken by ixev_recv_hold()
+ * @ctx: the context
+ * @ref: the hold
+ *
+ * Holds may be released in any order.
+ */
+void ixev_recv_release(struct ixev_ctx *ctx, struct ixev_recv_ref *ref) {
+    size_t acked;
+
+    ref->released = true;
+    while (ctx->rref_head && ctx->rref_head->released)
+        ctx->rref_head = ctx->rref_head->next;
+
+    acked = ctx->rref_head ? ctx->rref_head->recv_pos : ctx->recv_total;
+    if (acked != ctx->recv_acked && !ctx->is_dead) {
+        __ixev_recv_done(ctx, acked - ctx->recv_acked);
+        ctx->recv_acked = acked;
+    }
+}
+
 static struct sg_entry *ixev_next_entry(struct ixev_ctx *ctx) {
     struct sg_entry *ent = &ctx->send[ctx->send_count];
 
@@ -522,6 +642,60 @@ ssize_t ixev_send_zc(struct ixev_ctx *ctx, void *addr, size_t len) {
     return actual_len;
 }
 
+/*
+ * ixev_sendv_zc - send a list of buffers using zero-copy
+ * @ctx: the context
+ * @ents: the buffers
+ * @nrents: the number of buffers
+ *
+ * The buffers join the pending sends of @ctx, which go to the kernel in a
+ * single KSYS_TCP_SENDV, so e.g. a response header and its payload need
+ * one call and one descriptor. As much of the list is taken as the send
+ * window and the SG array allow; the caller resumes from the returned
+ * offset. As with ixev_send_zc(), the buffers must stay valid until a
+ * callback registered with ixev_add_sent_cb() runs.
+ *
+ * Returns the number of bytes sent, -EAGAIN if the send window is full,
+ * -ENOBUFS if the SG array is full, or -EIO if the connection is dead.
+ */
+ssize_t ixev_sendv_zc(struct ixev_ctx *ctx, struct sg_entry *ents,
+                      unsigned int nrents) {
+    size_t win_left = ixev_window_len(ctx, IXEV_SEND_WIN_SIZE);
+    ssize_t so_far = 0;
+    unsigned int i;
+
+    if (ctx->is_dead)
+        return -EIO;
+    if (!win_left)
+        return -EAGAIN;
+    if (ctx->send_count >= IXEV_SEND_DEPTH)
+        return -ENOBUFS;
+
+    ctx->cur_buf = NULL;
+
+    for (i = 0; i < nrents && win_left; i++) {
+        struct sg_entry *ent;
+        size_t len = min(ents[i].len, win_left);
+
+        if (!len)
+            continue;
+        if (ctx->send_count >= IXEV_SEND_DEPTH)
+            break;
+
+        ent = &ctx->send[ctx->send_count++];
+        ent->base = ents[i].base;
+        ent->len = len;
+        so_far += len;
+        win_left -= len;
+    }
+
+    if (so_far) {
+        __ixev_sendv(ctx, ctx->send, ctx->send_count);
+        ixev_update_send_stats(ctx, so_far);
+    }
+    return so_far;
+}
+
 /**
  * ixev_add_sent_cb - registers a callback for when all current sends complete
  * @ctx: the context
@@ -598,15 +772,27 @@ void ixev_nvme_writev(hqu_t fg_handle, void **sgls,
                      lba, lba_count, cookie);
 }
 
+void ixev_nvme_writev_sg(hqu_t fg_handle, struct sg_entry *ents,
+                         int nrents, unsigned long lba, unsigned int lba_count,
+                         unsigned long cookie) {
+    if (unlikely(karr->len >= karr->max_len)) {
+        printf("ixev: ran out of command space 3\n");
+        exit(-1);
+    }
+
+    ksys_nvme_writev_sg(__bsys_arr_next(karr), fg_handle, ents, nrents,
+                        lba, lba_count, cookie);
+}
+
 void ixev_nvme_register_flow(long flow_group_id, unsigned long cookie, unsigned int latency_us_SLO,
-                             unsigned long IOPS_SLO, int rw_ratio_SLO) {
+                             unsigned long IOPS_SLO, int rw_ratio_SLO, unsigned int be_weight) {
     if (unlikely(karr->len >= karr->max_len)) {
         printf("ixev: ran out of command space 4\n");
         exit(-1);
     }
     //	printf("IXEV: rw_ratio_SLO is %f\n", rw_ratio_SLO);
     ksys_nvme_register_flow(__bsys_arr_next(karr), flow_group_id, cookie,
-                            latency_us_SLO, IOPS_SLO, rw_ratio_SLO);
+                            latency_us_SLO, IOPS_SLO, rw_ratio_SLO, be_weight);
 }
 
 void ixev_nvme_unregister_flow(long flow_group_id) {
@@ -638,6 +824,11 @@ void ixev_ctx_init(struct ixev_ctx *ctx) {
     ctx->sent_total = 0;
     ctx->ref_head = NULL;
     ctx->cur_buf = NULL;
+
+    ctx->recv_total = 0;
+    ctx->recv_acked = 0;
+    ctx->rref_head = NULL;
+    ctx->rref_tail = NULL;
 }
 
 /**
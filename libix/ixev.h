@@ -76,6 +76,7 @@ struct ixev_ctx;
 struct ixev_nvme_ioq_ctx;
 struct ixev_nvme_req_ctx;
 struct ixev_ref;
+struct ixev_recv_ref;
 struct ixev_buf;
 
 /*
@@ -99,7 +100,8 @@ struct ixev_conn_ops {
 };
 
 struct ixev_nvme_ops {
-    void (*opened)(hqu_t handle, unsigned long ns_size, unsigned long ns_sector_size);
+    void (*opened)(hqu_t handle, unsigned long ns_size, unsigned long ns_sector_size,
+                   unsigned long flags);
     void (*registered_flow)(long flow_group_id, struct ixev_ctx *ctx, long ret);
     void (*unregistered_flow)(long flow_group_id, long ret);
 };
@@ -125,6 +127,15 @@ struct ixev_ref {
     struct ixev_ref *next; /* the next ref in the sequence */
 };
 
+/*
+ * A hold on received data, see ixev_recv_hold()
+ */
+struct ixev_recv_ref {
+    size_t recv_pos;            /* the stream position of the held data */
+    bool released;              /* released, but data before it is held */
+    struct ixev_recv_ref *next; /* the next hold in the stream */
+};
+
 /**
  * context per connection
  */
@@ -146,6 +157,11 @@ struct ixev_ctx {
     struct ixev_ref *ref_tail; /* list tail of references */
     struct ixev_buf *cur_buf;  /* current buffer */
 
+    size_t recv_total;                /* the total consumed bytes */
+    size_t recv_acked;                /* the total bytes given back */
+    struct ixev_recv_ref *rref_head;  /* list head of receive holds */
+    struct ixev_recv_ref *rref_tail;  /* list tail of receive holds */
+
     struct bsys_desc *recv_done_desc; /* the current recv_done bsys descriptor */
     struct bsys_desc *sendv_desc;     /* the current sendv bsys descriptor */
 
@@ -194,8 +210,15 @@ static inline void ixev_check_hacks(struct ixev_ctx *ctx) {
 
 extern ssize_t ixev_recv(struct ixev_ctx *ctx, void *addr, size_t len);
 extern void *ixev_recv_zc(struct ixev_ctx *ctx, size_t len);
+extern void *ixev_recv_peek(struct ixev_ctx *ctx, size_t *len);
+extern int ixev_recv_hold(struct ixev_ctx *ctx, size_t len,
+                          struct sg_entry *ents, int nrents,
+                          struct ixev_recv_ref *ref);
+extern void ixev_recv_release(struct ixev_ctx *ctx, struct ixev_recv_ref *ref);
 extern ssize_t ixev_send(struct ixev_ctx *ctx, void *addr, size_t len);
 extern ssize_t ixev_send_zc(struct ixev_ctx *ctx, void *addr, size_t len);
+extern ssize_t ixev_sendv_zc(struct ixev_ctx *ctx, struct sg_entry *ents,
+                             unsigned int nrents);
 extern void ixev_add_sent_cb(struct ixev_ctx *ctx, struct ixev_ref *ref);
 
 extern void ixev_close(struct ixev_ctx *ctx);
@@ -211,9 +234,12 @@ extern void ixev_nvme_readv(hqu_t fg_handle, void **sgls,
 extern void ixev_nvme_writev(hqu_t fg_handle, void **sgls,
                              int num_sgls, unsigned long lba, unsigned int lba_count,
                              unsigned long cookie);
+extern void ixev_nvme_writev_sg(hqu_t fg_handle, struct sg_entry *ents,
+                                int nrents, unsigned long lba, unsigned int lba_count,
+                                unsigned long cookie);
 
 extern void ixev_nvme_register_flow(long flow_group_id, unsigned long cookie, unsigned int latency_us_SLO,
-                                    unsigned long IOPS_SLO, int rw_ratio_SLO);
+                                    unsigned long IOPS_SLO, int rw_ratio_SLO, unsigned int be_weight);
 extern void ixev_nvme_unregister_flow(long flow_group_id);
 
 /**
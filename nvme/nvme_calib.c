@@ -0,0 +1,403 @@
+/*
+ * Copyright (c) 2015-2017, Stanford University
+ *  
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  * Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * nvme_calib.c - derives a device model (.devmodel) from the local SSD
+ *
+ * Automates the procedure described in sample.devmodel when nvme_calibrate
+ * is set: core 0 drives the SSD behind its qpair with random I/O of several
+ * read/write mixes, sizes and offered loads, measures the p95 read latency,
+ * fits the request costs and token limits and writes them as a devmodel.
+ *
+ * Request costs are fitted at saturation: if the device sustains C 4KB
+ * reads/s, a mix sustaining R reads/s and W writes/s should cost R + w * W
+ * = C reads, and w, the relative write cost, is the least squares solution
+ * over all mixes. The cost_table scales the 4KB costs by the ratio of the
+ * 4KB saturation IOPS to those at every other size.
+ *
+ * WARNING: calibration overwrites data on the device.
+ */
+
+#include <ix/cfg.h>
+#include <ix/cpu.h>
+#include <ix/errno.h>
+#include <ix/log.h>
+#include <ix/stddef.h>
+#include <ix/timer.h>
+#include <math.h>
+#include <nvme/nvme_calib.h>
+#include <nvme/nvme_lat.h>
+#include <nvme/nvmedev.h>
+#include <spdk/env.h>
+#include <spdk/nvme.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CALIB_NS_ID 1
+#define CALIB_DEPTH 256  // outstanding I/Os of a closed loop run
+#define CALIB_MAX_IO_SIZE (128 * 1024)
+#define CALIB_WARMUP_US 500000UL
+#define CALIB_RUN_US 2000000UL
+#define CALIB_LOAD_STEPS 10  // offered loads per latency curve
+#define CALIB_READ_COST 100  // read_cost_4KB, as recommended in sample.devmodel
+#define CALIB_MAX_POINTS (CALIB_LOAD_STEPS * ARRAY_SIZE(calib_mixes))
+
+static const int calib_mixes[] = {90, 75, 50};  // read percentage
+static const unsigned int calib_sizes[] = {512,   1024,  2048,  4096, 8192,
+                                           16384, 32768, 65536, 131072};
+
+struct calib_io {
+    unsigned long start;
+    bool write;
+    struct calib_io *next;
+};
+
+struct calib_result {
+    double rd_iops;
+    double wr_iops;
+    unsigned long p95_us;  // of reads
+};
+
+struct calib_point {
+    unsigned long p95_us;
+    double tokens;  // tokens/s
+};
+
+static struct calib_io calib_ios[CALIB_DEPTH];
+static struct calib_io *calib_free;
+static int calib_inflight;
+static unsigned long calib_errors;
+
+// completions of I/Os issued in [calib_from, calib_until) are measured
+static unsigned long calib_from, calib_until;
+static unsigned long calib_reads, calib_writes;
+static uint32_t calib_hist[NVME_LAT_BUCKETS];
+
+static struct spdk_nvme_ns *calib_ns;
+static struct spdk_nvme_qpair *calib_qp;
+static void *calib_buf;
+static uint64_t calib_seed = 88172645463325252ULL;
+
+static inline uint64_t calib_rand(void) {
+    calib_seed ^= calib_seed << 13;
+    calib_seed ^= calib_seed >> 7;
+    calib_seed ^= calib_seed << 17;
+    return calib_seed;
+}
+
+static void calib_cb(void *arg, const struct spdk_nvme_cpl *cpl) {
+    struct calib_io *io = arg;
+
+    if (spdk_nvme_cpl_is_error(cpl)) calib_errors++;
+
+    if (io->start >= calib_from && io->start < calib_until) {
+        if (io->write) {
+            calib_writes++;
+        } else {
+            calib_reads++;
+            calib_hist[lat_bucket((rdtsc() - io->start) / cycles_per_us)]++;
+        }
+    }
+
+    io->next = calib_free;
+    calib_free = io;
+    calib_inflight--;
+}
+
+static int calib_issue(int rd_pct, unsigned int lba_count, uint64_t nr_slots) {
+    struct calib_io *io = calib_free;
+    uint64_t lba = (calib_rand() % nr_slots) * lba_count;
+    int ret;
+
+    io->write = (int)(calib_rand() % 100) >= rd_pct;
+    io->start = rdtsc();
+    if (io->write)
+        ret = spdk_nvme_ns_cmd_write(calib_ns, calib_qp, calib_buf, lba,
+                                     lba_count, calib_cb, io, 0);
+    else
+        ret = spdk_nvme_ns_cmd_read(calib_ns, calib_qp, calib_buf, lba,
+                                    lba_count, calib_cb, io, 0);
+    if (ret) return ret;
+
+    calib_free = io->next;
+    calib_inflight++;
+    return 0;
+}
+
+/*
+ * calib_run - one measurement point
+ * @rd_pct: percentage of reads
+ * @size: request size in bytes
+ * @iops: offered load (open loop), 0 to keep CALIB_DEPTH I/Os outstanding
+ * @res: the achieved throughput and read tail latency
+ */
+static void calib_run(int rd_pct, unsigned int size, double iops,
+                      struct calib_result *res) {
+    unsigned int lba_count = size / spdk_nvme_ns_get_sector_size(calib_ns);
+    uint64_t nr_slots = spdk_nvme_ns_get_num_sectors(calib_ns) / lba_count;
+    double interval = iops ? cycles_per_us * 1E6 / iops : 0;
+    double next;
+    unsigned long now, start = rdtsc();
+
+    calib_from = start + CALIB_WARMUP_US * cycles_per_us;
+    calib_until = calib_from + CALIB_RUN_US * cycles_per_us;
+    calib_reads = calib_writes = 0;
+    memset(calib_hist, 0, sizeof(calib_hist));
+
+    next = start;
+    while ((now = rdtsc()) < calib_until) {
+        while (calib_free && (!iops || now >= next)) {
+            if (calib_issue(rd_pct, lba_count, nr_slots)) break;
+            next += interval;
+        }
+        // the device can't keep up: don't let the backlog grow unbounded
+        if (iops && now > next + interval * CALIB_DEPTH) next = now;
+        spdk_nvme_qpair_process_completions(calib_qp, 0);
+    }
+    while (calib_inflight) spdk_nvme_qpair_process_completions(calib_qp, 0);
+
+    res->rd_iops = calib_reads * 1E6 / CALIB_RUN_US;
+    res->wr_iops = calib_writes * 1E6 / CALIB_RUN_US;
+    res->p95_us =
+        calib_reads ? lat_percentile(calib_hist, calib_reads, 95) : 0;
+    log_info("calib: %3d%% rd %6uB offered %8.0f IOPS: rd %8.0f wr %8.0f "
+             "IOPS, p95 rd %lu us\n",
+             rd_pct, size, iops, res->rd_iops, res->wr_iops, res->p95_us);
+}
+
+/*
+ * calib_curve - p95 read latency vs. token rate of a 4KB mix from light
+ * load up to its saturation throughput sat_iops
+ *
+ * The curve is made monotonic, as the scheduler expects more tokens to
+ * never lower the latency.
+ */
+static void calib_curve(int rd_pct, double sat_iops, int write_cost,
+                        struct calib_point *curve) {
+    struct calib_result res;
+    int i;
+
+    for (i = 0; i < CALIB_LOAD_STEPS; i++) {
+        calib_run(rd_pct, 4096, sat_iops * (i + 1) / CALIB_LOAD_STEPS, &res);
+        curve[i].tokens =
+            res.rd_iops * CALIB_READ_COST + res.wr_iops * write_cost;
+        curve[i].p95_us = res.p95_us;
+        if (i && curve[i].p95_us < curve[i - 1].p95_us)
+            curve[i].p95_us = curve[i - 1].p95_us;
+        if (i && curve[i].tokens < curve[i - 1].tokens)
+            curve[i].tokens = curve[i - 1].tokens;
+    }
+}
+
+// token rate a curve sustains at p95 latency lat_us, 0 if it never does
+static double calib_tokens_at(const struct calib_point *curve,
+                              unsigned long lat_us) {
+    int i;
+
+    if (lat_us < curve[0].p95_us) return 0;
+    for (i = 0; i < CALIB_LOAD_STEPS - 1; i++)
+        if (curve[i + 1].p95_us > lat_us) break;
+    if (i == CALIB_LOAD_STEPS - 1 || curve[i + 1].p95_us == curve[i].p95_us)
+        return curve[i].tokens;
+    return curve[i].tokens + (curve[i + 1].tokens - curve[i].tokens) *
+                                 (lat_us - curve[i].p95_us) /
+                                 (curve[i + 1].p95_us - curve[i].p95_us);
+}
+
+static int cmp_ulong(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+
+    return (x > y) - (x < y);
+}
+
+static int calib_write_devmodel(const char *path, int write_cost,
+                                double max_tokens,
+                                const struct calib_point *rdonly,
+                                struct calib_point mixed[][CALIB_LOAD_STEPS],
+                                const double *rd_scale,
+                                const double *wr_scale) {
+    unsigned long lat[CALIB_MAX_POINTS];
+    double tokens, rd_tokens, prev = 0;
+    time_t now = time(NULL);
+    int i, m, n = 0;
+    FILE *f;
+
+    f = fopen(path, "w");
+    if (!f) {
+        log_err("calib: cannot open %s\n", path);
+        return -EIO;
+    }
+
+    fprintf(f, "# Device model generated by nvme_calibrate on %s", ctime(&now));
+    fprintf(f, "# 4KB random I/O, p95 read latency measured by a single core\n");
+    fprintf(f, "# with up to %d outstanding requests.\n\n", CALIB_DEPTH);
+    fprintf(f, "read_cost_4KB=%d\n", CALIB_READ_COST);
+    fprintf(f, "write_cost_4KB=%d\n\n", write_cost);
+
+    fprintf(f, "cost_table=(\n");
+    for (i = 0, n = 0; i < ARRAY_SIZE(calib_sizes); i++) {
+        if (!rd_scale[i]) continue;
+        fprintf(f, "%s  { size : %u, read : %ld, write : %ld }",
+                n++ ? ",\n" : "", calib_sizes[i],
+                max(lround(CALIB_READ_COST * rd_scale[i]), 1L),
+                max(lround(write_cost * wr_scale[i]), 1L));
+    }
+    fprintf(f, "\n)\n");
+    fprintf(f, "\nmax_token_rate=%.0f\n\ntoken_limits=(\n", max_tokens);
+
+    // one entry for every latency seen on a mixed curve
+    n = 0;
+    for (m = 0; m < ARRAY_SIZE(calib_mixes); m++)
+        for (i = 0; i < CALIB_LOAD_STEPS; i++)
+            lat[n++] = mixed[m][i].p95_us;
+    qsort(lat, n, sizeof(lat[0]), cmp_ulong);
+
+    for (i = 0; i < n; i++) {
+        if (!lat[i] || (i && lat[i] == lat[i - 1])) continue;
+        tokens = max_tokens;
+        for (m = 0; m < ARRAY_SIZE(calib_mixes); m++)
+            tokens = min(tokens, calib_tokens_at(mixed[m], lat[i]));
+        if (tokens <= prev) continue;
+        rd_tokens = max(calib_tokens_at(rdonly, lat[i]), tokens);
+        fprintf(f, "%s  {\n", prev ? ",\n" : "");
+        fprintf(f, "    p95_latency_limit     : %lu\t#in us\n", lat[i]);
+        fprintf(f, "    max_token_rate        : %.0f\t#in tokens\n", tokens);
+        fprintf(f, "    max_rdonly_token_rate : %.0f\t#in tokens\n", rd_tokens);
+        fprintf(f, "  }");
+        prev = tokens;
+    }
+    fprintf(f, "\n)\n");
+    fclose(f);
+    return 0;
+}
+
+/**
+ * nvme_calibrate - profiles the core's SSD and writes a devmodel file
+ * @path: the devmodel file to write
+ *
+ * Runs on core 0 after initialization instead of the server. Takes a few
+ * minutes and overwrites data on the device.
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int nvme_calibrate(const char *path) {
+    struct calib_result sat, res, rd_sat, wr_sat;
+    struct calib_result mix_sat[ARRAY_SIZE(calib_mixes)];
+    struct calib_point rdonly[CALIB_LOAD_STEPS];
+    struct calib_point mixed[ARRAY_SIZE(calib_mixes)][CALIB_LOAD_STEPS];
+    double rd_scale[ARRAY_SIZE(calib_sizes)] = {0};
+    double wr_scale[ARRAY_SIZE(calib_sizes)] = {0};
+    double num = 0, den = 0, w, c_read, max_tokens;
+    unsigned int sector_size;
+    int i, write_cost, ret;
+
+    calib_ns = nvme_qpair_ns(CALIB_NS_ID);
+    calib_qp = percpu_get(qpair);
+    if (!calib_ns || !calib_qp) {
+        log_err("calib: no NVMe device to calibrate\n");
+        return -ENODEV;
+    }
+    sector_size = spdk_nvme_ns_get_sector_size(calib_ns);
+
+    calib_buf = spdk_dma_zmalloc(CALIB_MAX_IO_SIZE, 4096, NULL);
+    if (!calib_buf) return -ENOMEM;
+    calib_free = NULL;
+    for (i = 0; i < CALIB_DEPTH; i++) {
+        calib_ios[i].next = calib_free;
+        calib_free = &calib_ios[i];
+    }
+
+    log_info("calib: profiling the NVMe device, this overwrites its data "
+             "and takes about %d s\n",
+             (int)((3 + ARRAY_SIZE(calib_mixes) * (CALIB_LOAD_STEPS + 1) +
+                    CALIB_LOAD_STEPS + 2 * ARRAY_SIZE(calib_sizes)) *
+                   (CALIB_WARMUP_US + CALIB_RUN_US) / 1000000));
+
+    // 4KB read-only saturation and latency curve
+    calib_run(100, 4096, 0, &sat);
+    c_read = sat.rd_iops;
+    if (!c_read) {
+        log_err("calib: the device completed no reads\n");
+        ret = -EIO;
+        goto out;
+    }
+    calib_curve(100, c_read, 0, rdonly);
+
+    // relative write cost from the saturation throughput of rd/wr mixes
+    for (i = 0; i < ARRAY_SIZE(calib_mixes); i++) {
+        calib_run(calib_mixes[i], 4096, 0, &mix_sat[i]);
+        num += (c_read - mix_sat[i].rd_iops) * mix_sat[i].wr_iops;
+        den += mix_sat[i].wr_iops * mix_sat[i].wr_iops;
+    }
+    w = den ? num / den : 1;
+    write_cost = max((int)lround(CALIB_READ_COST * w), 1);
+    log_info("calib: write cost %d (read cost %d)\n", write_cost,
+             CALIB_READ_COST);
+
+    // latency vs. token rate of every mix
+    max_tokens = c_read * CALIB_READ_COST;
+    for (i = 0; i < ARRAY_SIZE(calib_mixes); i++) {
+        calib_curve(calib_mixes[i], mix_sat[i].rd_iops + mix_sat[i].wr_iops,
+                    write_cost, mixed[i]);
+        max_tokens = max(max_tokens, mixed[i][CALIB_LOAD_STEPS - 1].tokens);
+    }
+
+    // size scaling at saturation, relative to 4KB of the same type
+    calib_run(0, 4096, 0, &wr_sat);
+    for (i = 0; i < ARRAY_SIZE(calib_sizes); i++) {
+        if (calib_sizes[i] < sector_size || calib_sizes[i] % sector_size)
+            continue;
+        if (calib_sizes[i] == 4096) {
+            rd_scale[i] = wr_scale[i] = 1;
+            continue;
+        }
+        calib_run(100, calib_sizes[i], 0, &rd_sat);
+        calib_run(0, calib_sizes[i], 0, &res);
+        if (!rd_sat.rd_iops || !res.wr_iops) continue;
+        rd_scale[i] = c_read / rd_sat.rd_iops;
+        wr_scale[i] = wr_sat.wr_iops / res.wr_iops;
+    }
+
+    if (calib_errors)
+        log_err("calib: %lu requests failed, the model may be off\n",
+                calib_errors);
+
+    ret = calib_write_devmodel(path, write_cost, max_tokens, rdonly, mixed,
+                               rd_scale, wr_scale);
+    if (!ret) log_info("calib: device model written to %s\n", path);
+
+out:
+    spdk_dma_free(calib_buf);
+    return ret;
+}
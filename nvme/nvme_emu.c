@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2015-2017, Stanford University
+ *  
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  * Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * nvme_emu.c - latency-emulating flash backend
+ *
+ * Stands in for an SSD when nvme_device_model is "emulate:<file>", so the
+ * scheduler and network path can be measured without hardware. Requests are
+ * served by a fixed number of channels. Each channel is a FIFO whose
+ * completion times are monotonic, so polling only looks at channel heads.
+ *
+ * The device is emulated per core, just like each core owns its own qpair
+ * on a real device: the configured channels are divided among the cores.
+ */
+
+#include <ix/cfg.h>
+#include <ix/cpu.h>
+#include <ix/stddef.h>
+#include <ix/timer.h>
+#include <nvme/nvme_emu.h>
+#include <spdk/nvme.h>
+#include <stdio.h>
+
+#define NVME_EMU_MAX_CHANNELS 128
+
+struct emu_channel {
+    struct nvme_ctx *head;
+    struct nvme_ctx *tail;
+    unsigned long free_tsc;  // when the last queued request completes
+};
+
+RTE_DEFINE_PER_LCORE(struct emu_channel, emu_channels[NVME_EMU_MAX_CHANNELS]);
+RTE_DEFINE_PER_LCORE(int, emu_num_channels);
+RTE_DEFINE_PER_LCORE(int, emu_writes_inflight);
+RTE_DEFINE_PER_LCORE(unsigned long, emu_gc_writes);
+RTE_DEFINE_PER_LCORE(unsigned long, emu_gc_until);
+RTE_DEFINE_PER_LCORE(uint64_t, emu_seed);
+
+/**
+ * nvme_emu_init_cpu - sets up the core-local share of the emulated device
+ *
+ * Returns 0.
+ */
+int nvme_emu_init_cpu(void) {
+    int i, channels;
+
+    channels = emu_model.channels / max(cores_active, 1);
+    channels = min(max(channels, 1), NVME_EMU_MAX_CHANNELS);
+
+    for (i = 0; i < channels; i++) {
+        percpu_get(emu_channels[i]).head = NULL;
+        percpu_get(emu_channels[i]).tail = NULL;
+        percpu_get(emu_channels[i]).free_tsc = 0;
+    }
+    percpu_get(emu_num_channels) = channels;
+    percpu_get(emu_writes_inflight) = 0;
+    percpu_get(emu_gc_writes) = 0;
+    percpu_get(emu_gc_until) = 0;
+    percpu_get(emu_seed) = rdtsc() | 1;
+
+    printf("Emulated NVMe device: %d channels on this core\n", channels);
+    return 0;
+}
+
+/* xorshift64, cheap enough for the submission path */
+static inline uint64_t emu_rand(void) {
+    uint64_t x = percpu_get(emu_seed);
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    percpu_get(emu_seed) = x;
+    return x;
+}
+
+static unsigned long emu_service_us(const struct emu_op_latency *op,
+                                    unsigned long pages) {
+    unsigned long us = op->latency_us;
+
+    if (op->tail_pct > 0 &&
+        (emu_rand() % 1000000) < (uint64_t)(op->tail_pct * 10000))
+        us = op->tail_latency_us;
+    if (op->jitter_us)
+        us += emu_rand() % op->jitter_us;
+
+    return us + (pages - 1) * op->per_4KB_us;
+}
+
+/**
+ * nvme_emu_submit - queues a request on the least loaded emulated channel
+ * @ctx: the request
+ *
+ * The completion is delivered later by nvme_emu_process_completions().
+ */
+void nvme_emu_submit(struct nvme_ctx *ctx) {
+    struct emu_channel *ch, *c;
+    unsigned long now = rdtsc();
+    unsigned long pages, us, start;
+    int i;
+
+    pages = (ctx->lba_count * emu_model.sector_size + 4095) / 4096;
+    pages = max(pages, 1UL);
+
+    if (ctx->cmd == NVME_CMD_WRITE) {
+        us = emu_service_us(&emu_model.write, pages);
+    } else {
+        us = emu_service_us(&emu_model.read, pages);
+        if (percpu_get(emu_writes_inflight))
+            us += us * emu_model.rw_interference_pct / 100;
+    }
+
+    ch = &percpu_get(emu_channels[0]);
+    for (i = 1; i < percpu_get(emu_num_channels); i++) {
+        c = &percpu_get(emu_channels[i]);
+        if (c->free_tsc < ch->free_tsc)
+            ch = c;
+    }
+
+    start = max(now, ch->free_tsc);
+    start = max(start, percpu_get(emu_gc_until));
+    ch->free_tsc = start + us * cycles_per_us;
+
+    ctx->emu_done = ch->free_tsc;
+    ctx->emu_next = NULL;
+    if (ch->tail)
+        ch->tail->emu_next = ctx;
+    else
+        ch->head = ctx;
+    ch->tail = ctx;
+
+    if (ctx->cmd != NVME_CMD_WRITE)
+        return;
+
+    percpu_get(emu_writes_inflight)++;
+    if (!emu_model.gc_interval_writes)
+        return;
+    percpu_get(emu_gc_writes) += pages;
+    if (percpu_get(emu_gc_writes) >= emu_model.gc_interval_writes) {
+        // the whole device stalls once the triggering write is done
+        percpu_get(emu_gc_writes) = 0;
+        percpu_get(emu_gc_until) =
+            ch->free_tsc + emu_model.gc_pause_us * cycles_per_us;
+    }
+}
+
+/**
+ * nvme_emu_process_completions - completes requests whose time has come
+ * @max_completions: upper bound on completions to deliver
+ *
+ * Returns the number of completed requests.
+ */
+int nvme_emu_process_completions(int max_completions) {
+    static const struct spdk_nvme_cpl cpl;  // all zero: success
+    struct emu_channel *ch;
+    struct nvme_ctx *ctx;
+    unsigned long now = rdtsc();
+    int i, done = 0;
+
+    for (i = 0; i < percpu_get(emu_num_channels); i++) {
+        ch = &percpu_get(emu_channels[i]);
+        while (ch->head && ch->head->emu_done <= now &&
+               done < max_completions) {
+            ctx = ch->head;
+            ch->head = ctx->emu_next;
+            if (!ch->head)
+                ch->tail = NULL;
+
+            if (ctx->cmd == NVME_CMD_WRITE) {
+                percpu_get(emu_writes_inflight)--;
+                nvme_write_cb(ctx, &cpl);
+            } else {
+                nvme_read_cb(ctx, &cpl);
+            }
+            done++;
+        }
+    }
+    return done;
+}
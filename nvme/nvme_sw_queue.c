@@ -29,50 +29,244 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <ix/cpu.h>
 #include <ix/errno.h>
 #include <ix/log.h>
+#include <ix/mempool.h>
 #include <ix/timer.h>
+#include <limits.h>
 #include <nvme/nvme_sw_queue.h>
+#include <rte_per_lcore.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+/*
+ * Every size class gets the same amount of memory, and fewer rings as they
+ * get larger. Rings are only held while requests are queued, so this is
+ * sized by the requests in flight rather than by the number of tenants.
+ */
+#define NVME_SW_RING_SMALL_RINGS (1 << 16)
+
+static struct mempool_datastore ring_datastore[NVME_SW_RING_CLASSES];
+static char ring_datastore_name[NVME_SW_RING_CLASSES][32];
+
+RTE_DEFINE_PER_LCORE(struct mempool, ring_mempool[NVME_SW_RING_CLASSES]);
+
+/**
+ * nvme_sw_queue_init_datastores - allocate the ring slabs of all cores
+ */
+int nvme_sw_queue_init_datastores(void) {
+    int c, ret;
+
+    for (c = 0; c < NVME_SW_RING_CLASSES; c++) {
+        snprintf(ring_datastore_name[c], sizeof(ring_datastore_name[c]),
+                 "nvme_swq_ring%d", 1 << (c + NVME_SW_RING_MIN_ORDER));
+        ret = mempool_create_datastore(
+            &ring_datastore[c], NVME_SW_RING_SMALL_RINGS >> c,
+            sizeof(struct nvme_sw_entry) << (c + NVME_SW_RING_MIN_ORDER),
+            ring_datastore_name[c]);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+/**
+ * nvme_sw_queue_init_cpu - attach the core to the ring slabs
+ */
+int nvme_sw_queue_init_cpu(void) {
+    int c, ret;
+
+    for (c = 0; c < NVME_SW_RING_CLASSES; c++) {
+        ret = mempool_create(&percpu_get(ring_mempool[c]), &ring_datastore[c],
+                             MEMPOOL_SANITY_PERCPU, percpu_get(cpu_id));
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+static inline struct mempool *ring_mempool_of(unsigned int order) {
+    return &percpu_get(ring_mempool[order - NVME_SW_RING_MIN_ORDER]);
+}
+
+static inline unsigned int nvme_sw_ring_len(struct nvme_sw_ring *r) {
+    return r->head - r->tail;
+}
+
+static inline unsigned int nvme_sw_ring_cap(struct nvme_sw_ring *r) {
+    return r->buf ? r->mask + 1 : 0;
+}
+
+static void nvme_sw_ring_release(struct nvme_sw_ring *r) {
+    if (r->buf) mempool_free(ring_mempool_of(r->order), r->buf);
+    r->buf = NULL;
+    r->mask = 0;
+    r->head = 0;
+    r->tail = 0;
+}
+
+/*
+ * nvme_sw_ring_grow - move the ring to a buffer of the next size class
+ */
+static int nvme_sw_ring_grow(struct nvme_sw_ring *r) {
+    unsigned int order = r->buf ? r->order + 1 : NVME_SW_RING_MIN_ORDER;
+    unsigned int len = nvme_sw_ring_len(r), i;
+    struct nvme_sw_entry *buf;
+
+    if (order > NVME_SW_RING_MAX_ORDER) return -EAGAIN;
+    buf = mempool_alloc(ring_mempool_of(order));
+    if (buf == NULL) return -EAGAIN;
+
+    for (i = 0; i < len; i++) buf[i] = r->buf[(r->tail + i) & r->mask];
+    nvme_sw_ring_release(r);
+    r->buf = buf;
+    r->order = order;
+    r->mask = (1u << order) - 1;
+    r->head = len;
+    return 0;
+}
+
 void nvme_sw_queue_init(struct nvme_sw_queue *q, long fg_handle) {
-    q->count = 0;
-    q->head = 0;
-    q->tail = 0;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        q->ring[i].buf = NULL;
+        q->ring[i].mask = 0;
+        q->ring[i].order = 0;
+        q->ring[i].head = 0;
+        q->ring[i].tail = 0;
+        q->ring[i].vtime = 0;
+    }
     q->total_token_demand = 0;
     q->saved_tokens = 0;
     q->token_credit = 0;
+    q->token_frac = 0;
+    q->token_increment = 0;
+    q->backlogged = false;
     q->fg_handle = fg_handle;
 }
 
+void nvme_sw_queue_fini(struct nvme_sw_queue *q) {
+    nvme_sw_ring_release(&q->ring[NVME_CMD_READ]);
+    nvme_sw_ring_release(&q->ring[NVME_CMD_WRITE]);
+}
+
+/*
+ * nvme_sw_queue_next - the ring the next request is taken from
+ *
+ * The ring charged fewer tokens goes first, reads on a tie, so requests
+ * are interleaved in proportion to their cost.
+ */
+static inline struct nvme_sw_ring *nvme_sw_queue_next(struct nvme_sw_queue *q) {
+    struct nvme_sw_ring *rd = &q->ring[NVME_CMD_READ];
+    struct nvme_sw_ring *wr = &q->ring[NVME_CMD_WRITE];
+
+    if (wr->head == wr->tail) return rd;
+    if (rd->head == rd->tail) return wr;
+    return wr->vtime < rd->vtime ? wr : rd;
+}
+
+/*
+ * nvme_sw_queue_reserve - make sure n more requests of type cmd fit
+ */
+int nvme_sw_queue_reserve(struct nvme_sw_queue *q, int cmd, unsigned int n) {
+    struct nvme_sw_ring *r = &q->ring[cmd];
+
+    while (nvme_sw_ring_cap(r) - nvme_sw_ring_len(r) < n) {
+        if (nvme_sw_ring_grow(r)) return -EAGAIN;
+    }
+    return 0;
+}
+
 int nvme_sw_queue_push_back(struct nvme_sw_queue *q, struct nvme_ctx *ctx) {
-    if (q->count == NVME_SW_QUEUE_SIZE) {
+    struct nvme_sw_ring *r = &q->ring[ctx->cmd];
+    struct nvme_sw_ring *other = &q->ring[!ctx->cmd];
+    struct nvme_sw_entry *e;
+
+    if (nvme_sw_ring_len(r) == nvme_sw_ring_cap(r) && nvme_sw_ring_grow(r)) {
         log_info("nvme_sw_queue full!\n");
         return -EAGAIN;
     }
-    q->buf[q->head] = ctx;
-    q->head = (q->head + 1) % NVME_SW_QUEUE_SIZE;
-    q->count++;
+    /*
+     * A ring that was idle neither catches up on the other one nor is
+     * held back by what it was served before; with both idle, start over.
+     */
+    if (r->head == r->tail) {
+        if (other->head != other->tail) {
+            r->vtime = other->vtime;
+        } else {
+            r->vtime = 0;
+            other->vtime = 0;
+        }
+    }
+
+    e = &r->buf[r->head & r->mask];
+    e->ctx = ctx;
+    e->cost = ctx->req_cost;
+    r->head++;
     q->total_token_demand += ctx->req_cost;
     return 0;
 }
 
+/*
+ * nvme_sw_queue_earliest - the ring whose head has the earliest deadline
+ */
+static inline struct nvme_sw_ring *
+nvme_sw_queue_earliest(struct nvme_sw_queue *q) {
+    struct nvme_sw_ring *rd = &q->ring[NVME_CMD_READ];
+    struct nvme_sw_ring *wr = &q->ring[NVME_CMD_WRITE];
+
+    if (wr->head == wr->tail) return rd;
+    if (rd->head == rd->tail) return wr;
+    return wr->buf[wr->tail & wr->mask].ctx->deadline <
+                   rd->buf[rd->tail & rd->mask].ctx->deadline
+               ? wr
+               : rd;
+}
+
+static void nvme_sw_ring_pop(struct nvme_sw_queue *q, struct nvme_sw_ring *r,
+                             struct nvme_ctx **ctx) {
+    struct nvme_sw_entry *e;
+
+    e = &r->buf[r->tail & r->mask];
+    *ctx = e->ctx;
+    q->total_token_demand -= e->cost;
+    r->vtime += e->cost;
+    r->tail++;
+
+    if (r->head != r->tail) {
+        // the scheduler is likely to issue it next
+        prefetch0(r->buf[r->tail & r->mask].ctx);
+    } else {
+        // drained, give the buffer back
+        nvme_sw_ring_release(r);
+    }
+}
+
 int nvme_sw_queue_pop_front(struct nvme_sw_queue *q, struct nvme_ctx **ctx) {
-    if (q->count == 0) {
+    if (nvme_sw_queue_isempty(q)) {
         //log_info("ringbuf empty!\n");
         return -EAGAIN;
     }
-    *ctx = q->buf[q->tail];
-    q->total_token_demand -= q->buf[q->tail]->req_cost;
-    q->tail = (q->tail + 1) % NVME_SW_QUEUE_SIZE;
-    q->count--;
+    nvme_sw_ring_pop(q, nvme_sw_queue_next(q), ctx);
+    return 0;
+}
+
+/*
+ * nvme_sw_queue_pop_earliest - take the request with the earliest deadline
+ *
+ * For LC tenants, which are served earliest deadline first.
+ */
+int nvme_sw_queue_pop_earliest(struct nvme_sw_queue *q,
+                               struct nvme_ctx **ctx) {
+    if (nvme_sw_queue_isempty(q)) return -EAGAIN;
+    nvme_sw_ring_pop(q, nvme_sw_queue_earliest(q), ctx);
     return 0;
 }
 
 int nvme_sw_queue_isempty(struct nvme_sw_queue *q) {
-    if (q->count == 0) {
+    if (q->ring[NVME_CMD_READ].head == q->ring[NVME_CMD_READ].tail &&
+        q->ring[NVME_CMD_WRITE].head == q->ring[NVME_CMD_WRITE].tail) {
         return 1;
     } else {
         return 0;
@@ -80,10 +274,26 @@ int nvme_sw_queue_isempty(struct nvme_sw_queue *q) {
 }
 
 int nvme_sw_queue_peak_head_cost(struct nvme_sw_queue *q) {
-    if (q->count == 0)
+    struct nvme_sw_ring *r;
+
+    if (nvme_sw_queue_isempty(q))
         return -1;
 
-    return q->buf[q->tail]->req_cost;
+    r = nvme_sw_queue_next(q);
+    return r->buf[r->tail & r->mask].cost;
+}
+
+/*
+ * nvme_sw_queue_head_deadline - the earliest deadline of the two ring heads
+ */
+unsigned long nvme_sw_queue_head_deadline(struct nvme_sw_queue *q) {
+    struct nvme_sw_ring *r;
+
+    if (nvme_sw_queue_isempty(q))
+        return ULONG_MAX;
+
+    r = nvme_sw_queue_earliest(q);
+    return r->buf[r->tail & r->mask].ctx->deadline;
 }
 
 unsigned long nvme_sw_queue_save_tokens(struct nvme_sw_queue *q, unsigned long tokens) {
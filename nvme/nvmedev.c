@@ -32,16 +32,23 @@
 
 #include <ix/atomic.h>
 #include <ix/cfg.h>
+#include <ix/control_plane.h>
 #include <ix/errno.h>
+#include <ix/hash.h>
 #include <ix/log.h>
 #include <ix/mempool.h>
 #include <ix/syscall.h>
 #include <limits.h>
 #include <math.h>
+#include <nvme/nvme_emu.h>
+#include <nvme/nvme_lat.h>
 #include <nvme/nvme_sw_queue.h>
 #include <nvme/nvmedev.h>
+#include <rte_atomic.h>
 #include <rte_per_lcore.h>
 #include <spdk/nvme.h>
+#include <spdk/version.h>
+#include <stdlib.h>
 #include <sys/socket.h>
 
 // #define NO_SCHED
@@ -50,19 +57,33 @@ static struct spdk_nvme_ctrlr *nvme_ctrlr[CFG_MAX_NVMEDEV] = {NULL};
 static long global_ns_id = 1;
 static long global_ns_size = 1;
 static long global_ns_sector_size = 1;
+static long global_ns_open_flags = 0;  // NVME_OPEN_*, reported at open
 static long active_nvme_devices = 0;
 static int cpu_per_ssd = 1;
+
+/* striped logical volume across CFG.stripe_members (CFG.stripe_unit != 0) */
+#define NVME_STRIPE_MAX_CHILDREN 256  // 1MB request over 4KB stripe units
+static struct spdk_nvme_ctrlr *stripe_ctrlr[CFG_MAX_NVMEDEV] = {NULL};
+static struct spdk_nvme_ns *stripe_ns[CFG_MAX_NVMEDEV] = {NULL};
+static int stripe_width = 0;
+static unsigned long stripe_unit_lbas = 1;
 // struct pci_dev *g_nvme_dev[CFG_MAX_NVMEDEV];
 
 #define MAX_OPEN_BATCH 32
 #define NUM_NVME_REQUESTS (4096 * 256)  // 4096 * 64 //1024
 #define SGL_PAGE_SIZE \
     4096  // should match PAGE_SIZE defined in dp/core/reflex_server.c
-#define DEFAULT_IO_QUEUE_SIZE 256
+#define DEFAULT_IO_QUEUE_SIZE 1024  // override with nvme_queue_depth
+
+static unsigned int nvme_qp_depth = DEFAULT_IO_QUEUE_SIZE;
 
 RTE_DEFINE_PER_LCORE(int, open_ev[MAX_OPEN_BATCH]);
 RTE_DEFINE_PER_LCORE(int, open_ev_ptr);
 RTE_DEFINE_PER_LCORE(struct spdk_nvme_qpair *, qpair);
+RTE_DEFINE_PER_LCORE(struct spdk_nvme_qpair *, stripe_qpair[CFG_MAX_NVMEDEV]);
+RTE_DEFINE_PER_LCORE(unsigned int, qp_inflight[CFG_MAX_NVMEDEV]);
+RTE_DEFINE_PER_LCORE(unsigned int, qp_unrung[CFG_MAX_NVMEDEV]);
+RTE_DEFINE_PER_LCORE(struct list_head, nvme_deferred);
 RTE_DEFINE_PER_LCORE(bool, mempool_initialized);
 
 static DEFINE_SPINLOCK(nvme_bitmap_lock);
@@ -75,29 +96,92 @@ static struct nvme_flow_group nvme_fgs[MAX_NVME_FLOW_GROUPS];
 static unsigned long global_token_rate =
     UINT_MAX;  // max token rate device can handle for current strictest latency
                // SLO
-static atomic_u64_t global_leftover_tokens =
-    ATOMIC_INIT(0);  // shared token bucket
 static unsigned long global_LC_sum_token_rate =
     0;  // LC tenant token reservation summed across all LC tenants globally
 static unsigned long global_num_best_effort_tenants =
     0;  // total num of best effort tenants
 static unsigned long global_num_lc_tenants =
     0;  // total num of latency critical tenants
-static atomic_t global_be_token_rate_per_tenant =
-    ATOMIC_INIT(0);  // token rate per best effort tenant
-static unsigned long global_lc_boost_no_BE =
-    0;  // fair share of leftover tokens that LC tenant can use when no BE
-        // registered
+static atomic_u64_t global_be_token_rate_per_weight =
+    ATOMIC_INIT(0);  // fixed-point tokens/cycle per unit of best effort weight
+static unsigned long global_be_weight_sum =
+    0;  // sum of the weights of all best effort tenants
+static atomic_u64_t global_lc_boost_no_BE =
+    ATOMIC_INIT(0);  // fixed-point tokens/cycle of leftover an LC tenant can
+                     // use when no BE registered
+static unsigned int global_lat_SLO =
+    UINT_MAX;  // strictest latency SLO among registered LC tenants
 
 #define MAX_NUM_THREADS 24
-static int scheduled_bit_vector[MAX_NUM_THREADS];
 
-#define TOKEN_FRAC_GIVEAWAY 0.9
+/*
+ * Leftover tokens are shared through one slot per core: a core donates into
+ * its own slot and only steals from the others when it is short, so no
+ * cache line is bounced between cores on every round. A slot word is
+ * epoch << NVME_EPOCH_SHIFT | tokens; tokens donated in an earlier epoch
+ * have expired. The epoch word is epoch << NVME_EPOCH_SHIFT | cores that
+ * have completed a round in it, and the last of them starts the next epoch.
+ */
+#define NVME_EPOCH_SHIFT 32
+#define NVME_EPOCH_LOW ((1UL << NVME_EPOCH_SHIFT) - 1)
+
+struct nvme_token_slot {
+    atomic_u64_t word;
+} __aligned(CACHE_LINE_SIZE);
+
+static struct nvme_token_slot leftover_slots[MAX_NUM_THREADS];
+static atomic_u64_t token_epoch __aligned(CACHE_LINE_SIZE) =
+    ATOMIC_INIT(1UL << NVME_EPOCH_SHIFT);
+
+/*
+ * A tenant registered with NVME_FG_TENANT has a flow group on every core
+ * hosting one of its connections. It is accounted once in the global rates,
+ * and each of its flow groups is scheduled by a share of its budget that
+ * follows the core's demand, see nvme_tenant_rebalance().
+ */
+#define NVME_MAX_SHARED_TENANTS 64
+#define NVME_TENANT_REBALANCE_US 1000
+
+struct nvme_tenant_demand {
+    atomic_u64_t tokens;  // smoothed tokens enqueued per rebalance interval
+} __aligned(CACHE_LINE_SIZE);
+
+struct nvme_tenant {
+    long flow_group_id;
+    atomic_t nr_cores;  // flow groups, changed under nvme_bitmap_lock
+    unsigned int latency_us_SLO;
+    unsigned long IOPS_SLO;
+    int rw_ratio_SLO;
+    unsigned int be_weight;
+    struct nvme_slo_node slo_node;
+    struct nvme_tenant_demand demand[MAX_NUM_THREADS];
+};
+
+static struct nvme_tenant nvme_tenants[NVME_MAX_SHARED_TENANTS];
+
+#define TOKEN_GIVEAWAY_PCT 90
+
+/*
+ * Token rates are kept as fixed-point tokens per TSC cycle so the scheduler
+ * only does integer math; the fraction of a token earned is carried to the
+ * next round instead of rounded. Deltas are capped so rate * delta fits in
+ * 64 bits, which only drops tokens after a long stall of the scheduler.
+ */
+#define NVME_TOKEN_FRAC_BITS 32
+#define NVME_TOKEN_FRAC_MASK ((1UL << NVME_TOKEN_FRAC_BITS) - 1)
+#define NVME_TOKEN_MAX_DELTA (1UL << 31)
 static long TOKEN_DEFICIT_LIMIT = 10000;
 static bool global_readonly_flag = true;
 
 #define SLO_REQ_SIZE 4096
 
+/* request cost per opcode at size classes 512B << c, see nvme_compute_req_cost */
+#define NVME_COST_MIN_SHIFT 9
+#define NVME_COST_CLASSES 12  // 512B to 1MB, extrapolated above
+#define NVME_COST_FRAC_BITS 16
+static unsigned long nvme_cost_base[2][NVME_COST_CLASSES];
+static unsigned long nvme_cost_slope[2][NVME_COST_CLASSES];  // 16.16 tokens/B
+
 RTE_DEFINE_PER_LCORE(struct mempool,
                      request_mempool __attribute__((aligned(64))));
 RTE_DEFINE_PER_LCORE(struct mempool, ctx_mempool __attribute__((aligned(64))));
@@ -109,14 +193,36 @@ RTE_DEFINE_PER_LCORE(struct nvme_tenant_mgmt, nvme_tenant_manager);
 
 RTE_DEFINE_PER_LCORE(unsigned long, last_sched_time);
 RTE_DEFINE_PER_LCORE(unsigned long, last_sched_time_be);
+RTE_DEFINE_PER_LCORE(unsigned long, be_token_frac);
+RTE_DEFINE_PER_LCORE(unsigned long, be_idle_frac);
+RTE_DEFINE_PER_LCORE(unsigned long, be_pool_frac);
+RTE_DEFINE_PER_LCORE(unsigned long, last_rebalance_time);
 RTE_DEFINE_PER_LCORE(unsigned long, local_extra_demand);
 RTE_DEFINE_PER_LCORE(unsigned long, local_leftover_tokens);
-RTE_DEFINE_PER_LCORE(int, roundrobin_start);
-
-static int nvme_compute_req_cost(int req_type, size_t req_len);
-
+RTE_DEFINE_PER_LCORE(unsigned long, token_epoch_seen);
+RTE_DEFINE_PER_LCORE(bool, steal_idle);
+RTE_DEFINE_PER_LCORE(unsigned long, steal_debt);
+
+// requests staged for a merged command, see nvme_merge_stage()
+RTE_DEFINE_PER_LCORE(struct nvme_ctx *, merge_first);
+RTE_DEFINE_PER_LCORE(struct nvme_ctx *, merge_last);
+RTE_DEFINE_PER_LCORE(unsigned long, merge_lbas);
+
+static inline int nvme_compute_req_cost(int req_type, size_t req_len);
+static struct spdk_nvme_ns *nvme_local_ns(void);
+static void nvme_submit_or_defer(struct nvme_ctx *ctx);
+static void nvme_merge_complete(struct nvme_ctx *cmd, int ret);
+static int nvme_split(struct nvme_ctx *ctx, unsigned long max_lbas,
+                      struct nvme_ctx **child);
+static int nvme_submit(struct nvme_ctx *ctx);
+
+static void init_req_cost_classes(void);
 static void set_token_deficit_limit(void);
 
+static inline unsigned long nvme_req_bytes(struct nvme_ctx *ctx) {
+    return (unsigned long)ctx->lba_count * global_ns_sector_size;
+}
+
 struct nvme_ctx *alloc_local_nvme_ctx(void) {
     return mempool_alloc(&percpu_get(ctx_mempool));
 }
@@ -129,7 +235,17 @@ struct nvme_sw_queue *alloc_local_nvme_swq(void) {
     return mempool_alloc(&percpu_get(nvme_swq_mempool));
 }
 
+/*
+ * nvme_enabled - true if this instance serves NVMe requests, either from
+ * real devices or from the emulated device (the client sets ns_size instead)
+ */
+static inline bool nvme_enabled(void) {
+    if (CFG.ns_sizes[0] != 0) return false;
+    return CFG.num_nvmedev > 0 || nvme_dev_model == EMULATED_FLASH;
+}
+
 void free_local_nvme_swq(struct nvme_sw_queue *q) {
+    nvme_sw_queue_fini(q);
     mempool_free(&percpu_get(nvme_swq_mempool), q);
 }
 /**
@@ -145,7 +261,7 @@ int init_nvme_request_cpu(void) {
         return 0;
     }
 
-    if (CFG.num_nvmedev == 0 || CFG.ns_sizes[0] != 0) {
+    if (!nvme_enabled()) {
         printf("No NVMe devices found, skipping initialization\n");
         return 0;
     }
@@ -169,14 +285,27 @@ int init_nvme_request_cpu(void) {
         // mempool_destroy(m);
         return ret;
     }
+    ret = nvme_sw_queue_init_cpu();
+    if (ret) return ret;
 
     thread_tenant_manager = &percpu_get(nvme_tenant_manager);
-    list_head_init(&thread_tenant_manager->tenant_swq);
+    list_head_init(&thread_tenant_manager->lc_tenants);
+    thread_tenant_manager->lc_heap = NULL;
+    thread_tenant_manager->lc_heap_cap = 0;
+    thread_tenant_manager->num_lc_tenants = 0;
+    list_head_init(&thread_tenant_manager->be_backlog);
+    list_head_init(&thread_tenant_manager->shared_fgs);
+    list_head_init(&percpu_get(nvme_deferred));
     thread_tenant_manager->num_tenants = 0;
     thread_tenant_manager->num_best_effort_tenants = 0;
-
-    percpu_get(last_sched_time) = timer_now();
-    percpu_get(last_sched_time_be) = rdtsc();  // timer_now();
+    thread_tenant_manager->num_be_backlogged = 0;
+    thread_tenant_manager->be_weight = 0;
+    thread_tenant_manager->be_backlog_weight = 0;
+
+    percpu_get(last_sched_time) = rdtsc();
+    percpu_get(last_sched_time_be) = rdtsc();
+    percpu_get(be_token_frac) = 0;
+    percpu_get(merge_first) = NULL;
     percpu_get(local_leftover_tokens) = 0;
     percpu_get(local_extra_demand) = 0;
     percpu_get(mempool_initialized) = true;
@@ -193,7 +322,7 @@ int init_nvme_request(void) {
     struct mempool_datastore *m2 = &ctx_datastore;
     struct mempool_datastore *m3 = &nvme_swq_datastore;
 
-    if (CFG.num_nvmedev == 0 || CFG.ns_sizes[0] != 0) {
+    if (!nvme_enabled()) {
         return 0;
     }
 
@@ -223,10 +352,13 @@ int init_nvme_request(void) {
         // mempool_pagemem_destroy(m);
         return ret;
     }
+    ret = nvme_sw_queue_init_datastores();
+    if (ret) return ret;
 
     // need to alloc req mempool for admin queue
     init_nvme_request_cpu();
 
+    init_req_cost_classes();
     set_token_deficit_limit();
 
     return 0;
@@ -253,12 +385,28 @@ static bool probe_cb(void *cb_ctx, struct spdk_pci_device *dev,
     return true;
 }
 
+static int stripe_member_index(struct spdk_pci_device *dev) {
+    int i;
+    struct pci_addr *addr;
+
+    for (i = 0; i < CFG.num_stripe_members; i++) {
+        addr = &CFG.stripe_members[i];
+        if (spdk_pci_device_get_domain(dev) == addr->domain &&
+            spdk_pci_device_get_bus(dev) == addr->bus &&
+            spdk_pci_device_get_dev(dev) == addr->slot &&
+            spdk_pci_device_get_func(dev) == addr->func)
+            return i;
+    }
+    return -1;
+}
+
 static void attach_cb(void *cb_ctx, struct spdk_pci_device *dev,
                       struct spdk_nvme_ctrlr *ctrlr,
                       const struct spdk_nvme_ctrlr_opts *opts) {
     unsigned int num_ns, nsid;
     const struct spdk_nvme_ctrlr_data *cdata;
     struct spdk_nvme_ns *ns = spdk_nvme_ctrlr_get_ns(ctrlr, 1);
+    int member;
 
     // /* FIXME: used for avoiding the default SSD */
     // if (spdk_nvme_ns_get_size(ns) == 0x35a800000) {
@@ -273,6 +421,14 @@ static void attach_cb(void *cb_ctx, struct spdk_pci_device *dev,
         panic("ERROR: only support %d nvme devices\n", CFG_MAX_NVMEDEV);
         return -RET_INVAL;
     }
+    if (CFG.stripe_unit) {
+        member = stripe_member_index(dev);
+        if (member >= 0) {
+            stripe_ctrlr[member] = ctrlr;
+            stripe_width++;
+            printf("Controller %p is stripe member %d\n", ctrlr, member);
+        }
+    }
     cdata = spdk_nvme_ctrlr_get_data(ctrlr);
 
     if (!spdk_nvme_ns_is_active(ns)) {
@@ -303,6 +459,9 @@ int init_nvmedev(void) {
     // devices\n");
     if (CFG.num_nvmedev == 0 || CFG.ns_sizes[0] != 0) {
         return 0;
+    } else if (nvme_dev_model == EMULATED_FLASH) {
+        printf("Emulated NVMe device, not probing nvme_devices\n");
+        return 0;
     } else if (CFG.num_nvmedev > cores_active) {
         // panic("ERROR: cores are fewer than SSDs\n");
         printf("WARNING: %d nvme devices are not available.\n",
@@ -329,33 +488,56 @@ int init_nvmedev(void) {
         printf("spdk_nvme_probe() failed\n");
         return 1;
     }
+    if (CFG.stripe_unit && stripe_width != CFG.num_stripe_members) {
+        log_err("nvmedev: only %d of %d stripe members attached\n",
+                stripe_width, CFG.num_stripe_members);
+        return -ENODEV;
+    }
     return 0;
 }
 
-int init_nvmeqp_cpu(void) {
-    if (CFG.num_nvmedev == 0 || CFG.ns_sizes[0] != 0) return 0;
-    assert(nvme_ctrlr);
-    struct spdk_nvme_ctrlr *ctrlr =
-        nvme_ctrlr[percpu_get(cpu_id) / cpu_per_ssd];
+static struct spdk_nvme_qpair *alloc_nvme_qpair(struct spdk_nvme_ctrlr *ctrlr) {
     struct spdk_nvme_io_qpair_opts opts;
 
     spdk_nvme_ctrlr_get_default_io_qpair_opts(ctrlr, &opts, sizeof(opts));
     printf("Deafult io qpair opts: %d, %d, %d\n", opts.qprio, opts.io_queue_size, opts.io_queue_requests);
     // opts.qprio = 0;
-    opts.io_queue_size = DEFAULT_IO_QUEUE_SIZE * 4;
+    opts.io_queue_size = min(nvme_qp_depth,
+                             spdk_nvme_ctrlr_get_regs_cap(ctrlr).bits.mqes + 1u);
     opts.io_queue_requests = opts.io_queue_size * 2;
+    // ring the SQ doorbell once per poll instead of once per command
+#if SPDK_VERSION_MAJOR > 19 || (SPDK_VERSION_MAJOR == 19 && SPDK_VERSION_MINOR >= 10)
+    opts.delay_cmd_submit = true;
+#elif SPDK_VERSION_MAJOR > 18 || (SPDK_VERSION_MAJOR == 18 && SPDK_VERSION_MINOR >= 10)
+    opts.delay_pcie_doorbell = true;
+#endif
+    // all cores see the same devices, so they settle on the same depth
+    nvme_qp_depth = opts.io_queue_size;
 
-    // while (opts.io_queue_size >= 1) {
-    //     // FIXME: naive mapping from CPU to SSDs
-    percpu_get(qpair) = spdk_nvme_ctrlr_alloc_io_qpair(ctrlr, &opts, sizeof(opts));
-    //     if percpu_get (qpair) {
-    //         printf("Successfully allocate qpair with io_queue_size %d\n", opts.io_queue_size);
-    //         break;
-    //     }
-    //     opts.io_queue_size /= 2;
-    // }
-    // if (percpu_get(qpair) == NULL)
-    // percpu_get(qpair) = spdk_nvme_ctrlr_alloc_io_qpair(ctrlr, NULL, 0);
+    return spdk_nvme_ctrlr_alloc_io_qpair(ctrlr, &opts, sizeof(opts));
+}
+
+int init_nvmeqp_cpu(void) {
+    int i;
+
+    if (!nvme_enabled()) return 0;
+    if (CFG.nvme_queue_depth) nvme_qp_depth = CFG.nvme_queue_depth;
+    if (nvme_dev_model == EMULATED_FLASH) return nvme_emu_init_cpu();
+    assert(nvme_ctrlr);
+
+    if (CFG.stripe_unit) {
+        // every core holds a qpair on every stripe member
+        for (i = 0; i < stripe_width; i++) {
+            percpu_get(stripe_qpair[i]) = alloc_nvme_qpair(stripe_ctrlr[i]);
+            assert(percpu_get(stripe_qpair[i]));
+        }
+        percpu_get(qpair) = percpu_get(stripe_qpair[0]);
+        return 0;
+    }
+
+    // FIXME: naive mapping from CPU to SSDs
+    percpu_get(qpair) =
+        alloc_nvme_qpair(nvme_ctrlr[percpu_get(cpu_id) / cpu_per_ssd]);
     assert(percpu_get(qpair));
 
     return 0;
@@ -475,9 +657,138 @@ static const char *get_status_string(uint16_t sct, uint16_t sc) {
     return nvme_get_string(entry, sc);
 }
 
+/*
+ * nvme_stripe_complete - retire a child of a split request and complete
+ * the parent once its last child is done
+ */
+static void nvme_stripe_complete(struct nvme_ctx *child) {
+    struct nvme_ctx *parent = child->parent;
+
+    free_local_nvme_ctx(child);
+    if (--parent->stripe_pending > 0) return;
+
+    if (parent->cmd == NVME_CMD_READ)
+        usys_nvme_response(parent->cookie, parent->user_buf.buf, RET_OK);
+    else
+        usys_nvme_written(parent->cookie, RET_OK);
+    free_local_nvme_ctx(parent);
+}
+
+/*
+ * Completions of requests stolen by another core (see nvme_steal()) are
+ * handed back to the owning core, which holds the connection and the
+ * request's memory, on a lock-free list that any core pushes to and the
+ * owner empties all at once.
+ */
+struct nvme_remote_list {
+    atomic_u64_t head;  // struct nvme_ctx *
+} __aligned(CACHE_LINE_SIZE);
+
+static struct nvme_remote_list remote_done[MAX_NUM_THREADS];
+
+static void nvme_complete_remote(struct nvme_ctx *ctx, int ret) {
+    atomic_u64_t *head = &remote_done[ctx->tid].head;
+    unsigned long old;
+
+    ctx->remote_ret = ret;
+    do {
+        old = atomic_u64_read(head);
+        ctx->remote_next = (struct nvme_ctx *)old;
+    } while (!atomic_u64_cmpxchg(head, old, (unsigned long)ctx));
+}
+
+/*
+ * nvme_complete - reply to a finished request, or pass it to its owner
+ */
+static void nvme_complete(struct nvme_ctx *ctx, int ret) {
+    if (ctx->tid != percpu_get(cpu_nr)) {
+        nvme_complete_remote(ctx, ret);
+        return;
+    }
+    if (ctx->parent) {
+        nvme_stripe_complete(ctx);
+        return;
+    }
+    if (ctx->merge_head) {
+        nvme_merge_complete(ctx, ret);
+        return;
+    }
+    if (ctx->cmd == NVME_CMD_READ)
+        usys_nvme_response(ctx->cookie, ctx->user_buf.buf, ret);
+    else
+        usys_nvme_written(ctx->cookie, ret);
+    free_local_nvme_ctx(ctx);
+}
+
+/*
+ * nvme_drain_remote - complete the requests other cores handed back
+ */
+static void nvme_drain_remote(void) {
+    atomic_u64_t *head = &remote_done[percpu_get(cpu_nr)].head;
+    struct nvme_ctx *ctx, *next;
+    unsigned long old;
+
+    if (!atomic_u64_read(head)) return;
+    do {
+        old = atomic_u64_read(head);
+    } while (!atomic_u64_cmpxchg(head, old, 0));
+
+    for (ctx = (struct nvme_ctx *)old; ctx; ctx = next) {
+        next = ctx->remote_next;
+        nvme_complete(ctx, ctx->remote_ret);
+    }
+}
+
+/*
+ * Tail latency control: read completions are binned per core and per device
+ * into cumulative latency histograms (see nvme_lat.h). Every
+ * NVME_TAIL_CTRL_INTERVAL_US one core diffs them into a sliding window,
+ * estimates p95/p99 per device and moves global_token_rate toward the
+ * strictest LC latency SLO.
+ */
+#define NVME_TAIL_CTRL_INTERVAL_US 10000
+#define NVME_TAIL_WINDOW 10  // intervals in the sliding window
+#define NVME_TAIL_MIN_SAMPLES 200
+#define NVME_TAIL_CTRL_GAIN 0.5
+#define NVME_TAIL_CTRL_MAX_DOWN 0.8  // per interval
+#define NVME_TAIL_CTRL_MAX_UP 1.05
+#define NVME_TAIL_CTRL_DEADBAND 0.9  // hold while tail is in [0.9, 1] x SLO
+
+// written by the owning core only, summed by the controlling core
+static uint32_t lat_hist[MAX_NUM_THREADS][CFG_MAX_NVMEDEV][NVME_LAT_BUCKETS];
+static uint32_t lat_hist_seen[CFG_MAX_NVMEDEV][NVME_LAT_BUCKETS];
+static uint32_t lat_window[NVME_TAIL_WINDOW][CFG_MAX_NVMEDEV][NVME_LAT_BUCKETS];
+static int lat_window_slot;
+static unsigned long last_tail_ctrl_time;
+
+static inline int nvme_num_devices(void) {
+    if (nvme_dev_model == EMULATED_FLASH) return 1;
+    if (CFG.stripe_unit) return stripe_width;
+    return active_nvme_devices;
+}
+
+static inline void nvme_lat_record(struct nvme_ctx *ctx) {
+    unsigned long us;
+    int dev;
+
+    if (!CFG.nvme_tail_pct) return;
+
+    if (nvme_dev_model == EMULATED_FLASH)
+        dev = 0;
+    else if (CFG.stripe_unit)
+        dev = ctx->qp_idx;
+    else
+        dev = percpu_get(cpu_id) / cpu_per_ssd;
+
+    us = (rdtsc() - ctx->time) / cycles_per_us;
+    lat_hist[percpu_get(cpu_nr)][dev][lat_bucket(us)]++;
+}
+
 void nvme_write_cb(void *ctx, const struct spdk_nvme_cpl *cpl) {
     struct nvme_ctx *n_ctx = (struct nvme_ctx *)ctx;
 
+    percpu_get(qp_inflight[n_ctx->qp_idx])--;
+
     if (spdk_nvme_cpl_is_error(cpl)) {
         printf("SPDK Write Failed!\n");
         printf(
@@ -488,14 +799,15 @@ void nvme_write_cb(void *ctx, const struct spdk_nvme_cpl *cpl) {
             cpl->status.p, cpl->status.m, cpl->status.dnr);
     }
 
-    usys_nvme_written(n_ctx->cookie, RET_OK);
-
-    free_local_nvme_ctx(n_ctx);
+    nvme_complete(n_ctx, RET_OK);
 }
 
 void nvme_read_cb(void *ctx, const struct spdk_nvme_cpl *cpl) {
     struct nvme_ctx *n_ctx = (struct nvme_ctx *)ctx;
 
+    percpu_get(qp_inflight[n_ctx->qp_idx])--;
+    nvme_lat_record(n_ctx);
+
     if (spdk_nvme_cpl_is_error(cpl)) {
         printf("SPDK Read Failed!\n");
         printf(
@@ -506,9 +818,65 @@ void nvme_read_cb(void *ctx, const struct spdk_nvme_cpl *cpl) {
             cpl->status.p, cpl->status.m, cpl->status.dnr);
     }
 
-    usys_nvme_response(n_ctx->cookie, n_ctx->user_buf.buf, RET_OK);
+    nvme_complete(n_ctx, RET_OK);
+}
+
+/*
+ * nvme_ctrlr_open_flags - narrow the NVME_OPEN_* flags to what ctrlr takes
+ *
+ * sg_entry lists need hardware SGLs, PRPs can't describe packet buffers.
+ */
+static long nvme_ctrlr_open_flags(struct spdk_nvme_ctrlr *ctrlr, long flags) {
+    const struct spdk_nvme_ctrlr_data *cdata = spdk_nvme_ctrlr_get_data(ctrlr);
+
+    if (!(spdk_nvme_ctrlr_get_flags(ctrlr) & SPDK_NVME_CTRLR_SGL_SUPPORTED))
+        return 0;
+    if (cdata->sgls.supported == SPDK_NVME_SGLS_SUPPORTED_DWORD_ALIGNED)
+        flags |= NVME_OPEN_SG_DWORD;
+    return flags;
+}
+
+/*
+ * nvme_stripe_open - expose the stripe members as one logical namespace
+ *
+ * Every member contributes the same number of whole stripe units, so the
+ * logical size is bounded by the smallest member.
+ */
+static long nvme_stripe_open(long ns_id) {
+    unsigned long member_size = ULONG_MAX;
+    unsigned long sector_size = 0;
+    struct spdk_nvme_ns *ns;
+    int i;
 
-    free_local_nvme_ctx(n_ctx);
+    for (i = 0; i < stripe_width; i++) {
+        ns = spdk_nvme_ctrlr_get_ns(stripe_ctrlr[i], ns_id);
+        if (!ns) {
+            printf("ERROR: stripe member %d has no namespace %ld\n", i, ns_id);
+            return -RET_INVAL;
+        }
+        if (sector_size && sector_size != spdk_nvme_ns_get_sector_size(ns)) {
+            printf("ERROR: stripe members have different sector sizes\n");
+            return -RET_INVAL;
+        }
+        sector_size = spdk_nvme_ns_get_sector_size(ns);
+        member_size = min(member_size, spdk_nvme_ns_get_size(ns));
+        stripe_ns[i] = ns;
+    }
+
+    global_ns_open_flags = NVME_OPEN_SG_ENTRIES;
+    for (i = 0; i < stripe_width; i++)
+        global_ns_open_flags = nvme_ctrlr_open_flags(stripe_ctrlr[i],
+                                                     global_ns_open_flags);
+
+    stripe_unit_lbas = CFG.stripe_unit / sector_size;
+    global_ns_sector_size = sector_size;
+    global_ns_size =
+        (member_size / CFG.stripe_unit) * CFG.stripe_unit * stripe_width;
+    printf("NVMe striped namespace size: %lu bytes, sector size: %lu, "
+           "%d members, stripe unit %lu bytes\n",
+           global_ns_size, global_ns_sector_size, stripe_width,
+           CFG.stripe_unit);
+    return RET_OK;
 }
 
 long bsys_nvme_open(long dev_id, long ns_id) {
@@ -530,9 +898,21 @@ long bsys_nvme_open(long dev_id, long ns_id) {
     bitmap_init(nvme_fgs_bitmap, MAX_NVME_FLOW_GROUPS, 0);
 
     percpu_get(open_ev[percpu_get(open_ev_ptr)++]) = ioq;
+    if (nvme_dev_model == EMULATED_FLASH) {
+        global_ns_size = emu_model.ns_size;
+        global_ns_sector_size = emu_model.sector_size;
+        global_ns_open_flags = NVME_OPEN_SG_ENTRIES;
+        printf("Emulated NVMe namespace size: %lu bytes, sector size: %lu\n",
+               global_ns_size, global_ns_sector_size);
+        return RET_OK;
+    }
+    if (CFG.stripe_unit) return nvme_stripe_open(ns_id);
+
     // FIXME: naive mapping from CPU to SSDs
     ns = spdk_nvme_ctrlr_get_ns(nvme_ctrlr[percpu_get(cpu_id) / cpu_per_ssd],
                                 ns_id);
+    global_ns_open_flags = nvme_ctrlr_open_flags(
+        nvme_ctrlr[percpu_get(cpu_id) / cpu_per_ssd], NVME_OPEN_SG_ENTRIES);
     global_ns_size = spdk_nvme_ns_get_size(ns);
     global_ns_sector_size = spdk_nvme_ns_get_sector_size(ns);
     printf("NVMe device namespace size: %lu bytes, sector size: %lu\n",
@@ -553,39 +933,125 @@ long bsys_nvme_close(long dev_id, long ns_id, hqu_t handle) {
     return RET_OK;
 }
 
+/*
+ * Flow group slots come from a free list and are found by (flow_group_id,
+ * core) in a hash table chained through the slots, so neither registering
+ * nor unregistering scans all MAX_NVME_FLOW_GROUPS. Slot 0 is never handed
+ * out and ends the chains. Both are protected by nvme_bitmap_lock.
+ */
+#define NVME_FG_HASH_SIZE MAX_NVME_FLOW_GROUPS  // power of 2
+
+static int nvme_fg_hash[NVME_FG_HASH_SIZE];
+static int nvme_fg_free[MAX_NVME_FLOW_GROUPS];
+static int nvme_fg_nr_free;
+static int nvme_fg_next_unused = 1;
+
+static inline int *nvme_fg_bucket(long flow_group_id, unsigned int tid) {
+    return &nvme_fg_hash[hash_city_two(flow_group_id, tid) &
+                         (NVME_FG_HASH_SIZE - 1)];
+}
+
 int set_nvme_flow_group_id(long flow_group_id, long *fg_handle_to_set) {
+    int *bucket = nvme_fg_bucket(flow_group_id, RTE_PER_LCORE(cpu_nr));
     int i;
-    int next_avail = 0;
-    // first check if already registered this flow
+
     spin_lock(&nvme_bitmap_lock);
-    for (i = 1; i < MAX_NVME_FLOW_GROUPS; i++) {
-        if (bitmap_test(nvme_fgs_bitmap, i)) {
-            // if already registered this flow group, return its index
-            if (nvme_fgs[i].flow_group_id == flow_group_id &&
-                nvme_fgs[i].tid == RTE_PER_LCORE(cpu_nr)) {
-                *fg_handle_to_set = i;
-                spin_unlock(&nvme_bitmap_lock);
-                return 1;
-            }
-        } else {
-            if (next_avail == 0) {
-                next_avail = i;
-            }
+    // if already registered this flow group, return its index
+    for (i = *bucket; i; i = nvme_fgs[i].hash_next) {
+        if (nvme_fgs[i].flow_group_id == flow_group_id &&
+            nvme_fgs[i].tid == RTE_PER_LCORE(cpu_nr)) {
+            *fg_handle_to_set = i;
+            spin_unlock(&nvme_bitmap_lock);
+            return 1;
         }
     }
 
-    if (next_avail == MAX_NVME_FLOW_GROUPS) {
+    if (nvme_fg_nr_free)
+        i = nvme_fg_free[--nvme_fg_nr_free];
+    else if (nvme_fg_next_unused < MAX_NVME_FLOW_GROUPS)
+        i = nvme_fg_next_unused++;
+    else {
         spin_unlock(&nvme_bitmap_lock);
         return -ENOMEM;
     }
 
-    bitmap_set(nvme_fgs_bitmap, next_avail);
+    nvme_fgs[i].flow_group_id = flow_group_id;
+    nvme_fgs[i].tid = RTE_PER_LCORE(cpu_nr);
+    nvme_fgs[i].conn_ref_count = 0;
+    nvme_fgs[i].hash_next = *bucket;
+    *bucket = i;
+    bitmap_set(nvme_fgs_bitmap, i);
     spin_unlock(&nvme_bitmap_lock);
 
-    *fg_handle_to_set = next_avail;
+    *fg_handle_to_set = i;
     return 0;
 }
 
+/*
+ * release_nvme_flow_group_id - unhash a flow group slot and free it
+ */
+static void release_nvme_flow_group_id(long fg_handle) {
+    struct nvme_flow_group *fg = &nvme_fgs[fg_handle];
+    int *link;
+
+    spin_lock(&nvme_bitmap_lock);
+    link = nvme_fg_bucket(fg->flow_group_id, fg->tid);
+    while (*link != fg_handle) link = &nvme_fgs[*link].hash_next;
+    *link = fg->hash_next;
+    bitmap_clear(nvme_fgs_bitmap, fg_handle);
+    nvme_fg_free[nvme_fg_nr_free++] = fg_handle;
+    spin_unlock(&nvme_bitmap_lock);
+}
+
+// cost of a request by the devmodel cost_table: interpolated between its
+// entries, proportional to size beyond the last one. Without a table the
+// 4KB costs scale linearly above 4KB.
+static double cost_table_at(int req_type, unsigned long len) {
+    const struct nvme_cost_point *p = nvme_cost_table;
+    double c0, c1;
+    int i;
+
+    if (!nvme_cost_table_size)
+        return (req_type == NVME_CMD_READ ? NVME_READ_COST : NVME_WRITE_COST) *
+               max(len / 4096.0, 1.0);
+
+    for (i = 0; i < nvme_cost_table_size; i++)
+        if (p[i].size >= len) break;
+    if (i == 0) return req_type == NVME_CMD_READ ? p[0].read : p[0].write;
+    if (i == nvme_cost_table_size) {
+        c1 = req_type == NVME_CMD_READ ? p[i - 1].read : p[i - 1].write;
+        return c1 * len / p[i - 1].size;
+    }
+    c0 = req_type == NVME_CMD_READ ? p[i - 1].read : p[i - 1].write;
+    c1 = req_type == NVME_CMD_READ ? p[i].read : p[i].write;
+    return c0 + (c1 - c0) * (len - p[i - 1].size) / (p[i].size - p[i - 1].size);
+}
+
+static void init_req_cost_classes(void) {
+    unsigned long size;
+    double base, next;
+    int op, c;
+
+    for (op = NVME_CMD_READ; op <= NVME_CMD_WRITE; op++) {
+        for (c = 0; c < NVME_COST_CLASSES; c++) {
+            size = 1UL << (c + NVME_COST_MIN_SHIFT);
+            base = cost_table_at(op, size);
+            next = cost_table_at(op, 2 * size);
+            nvme_cost_base[op][c] = (unsigned long)(base + 0.5);
+            nvme_cost_slope[op][c] =
+                next > base ? (unsigned long)((next - base) *
+                                              (1UL << NVME_COST_FRAC_BITS) /
+                                              size)
+                            : 0;
+        }
+    }
+    printf("DEVICE PARAMS: 512B read cost %lu, write cost %lu; "
+           "128KB read cost %d, write cost %d\n",
+           nvme_cost_base[NVME_CMD_READ][0], nvme_cost_base[NVME_CMD_WRITE][0],
+           nvme_compute_req_cost(NVME_CMD_READ, 131072),
+           nvme_compute_req_cost(NVME_CMD_WRITE, 131072));
+}
+
 // adjust token deficit limit to allow LC tenants to burst, but not too much
 static void set_token_deficit_limit(void) {
     printf("DEVICE PARAMS: read cost %d, write cost %d\n", NVME_READ_COST,
@@ -647,6 +1113,7 @@ unsigned long lookup_device_token_rate(unsigned int lat_SLO) {
         case FAKE_FLASH:
             return UINT_MAX;
         case FLASH_DEV_MODEL:
+        case EMULATED_FLASH:
             return find_token_limit_from_devmodel(lat_SLO);
         default:
             printf("WARNING: undefined flash device model\n");
@@ -674,30 +1141,161 @@ unsigned long scaled_IOPS(unsigned long IOPS, int rw_ratio_100) {
     return (unsigned long)(scaledIOPS + 0.5);
 }
 
-static void readjust_lc_tenant_token_limits(void) {
-    int i, j = 0;
-    for (i = 0; i < MAX_NVME_FLOW_GROUPS; i++) {
-        if (bitmap_test(nvme_fgs_bitmap, i)) {
-            if (nvme_fgs[i].latency_critical_flag) {
-                nvme_fgs[i].scaled_IOPuS_limit =
-                    (nvme_fgs[i].scaled_IOPS_limit + global_lc_boost_no_BE) /
-                    (double)1E6;
-                j++;
-                if (j == global_num_lc_tenants) {
-                    return;
-                }
-            }
-        }
+/*
+ * token_rate_to_fp - convert tokens/s to fixed-point tokens per TSC cycle
+ */
+static unsigned long token_rate_to_fp(unsigned long token_rate) {
+    return (unsigned long)((double)token_rate * (1UL << NVME_TOKEN_FRAC_BITS) /
+                               ((double)cycles_per_us * 1E6) +
+                           0.5);
+}
+
+/*
+ * tokens_earned - whole tokens accrued at fixed-point rate over delta cycles
+ *
+ * The leftover fraction of a token is kept in *frac for the next call.
+ */
+static inline unsigned long tokens_earned(unsigned long rate,
+                                          unsigned long delta,
+                                          unsigned long *frac) {
+    unsigned long lo;
+
+    delta = min(delta, NVME_TOKEN_MAX_DELTA);
+    lo = (rate & NVME_TOKEN_FRAC_MASK) * delta + *frac;
+    *frac = lo & NVME_TOKEN_FRAC_MASK;
+    return (rate >> NVME_TOKEN_FRAC_BITS) * delta + (lo >> NVME_TOKEN_FRAC_BITS);
+}
+
+/*
+ * nvme_weighted_tokens - tokens per unit of weight times a sched_weight,
+ * carrying the fraction of a token in *frac
+ */
+static inline unsigned long nvme_weighted_tokens(unsigned long tokens,
+                                                 unsigned long weight,
+                                                 unsigned long *frac) {
+    unsigned long t = tokens * weight + *frac;
+
+    *frac = t & (NVME_SHARE_ONE - 1);
+    return t >> NVME_SHARE_SHIFT;
+}
+
+/*
+ * nvme_fg_rate_fp - token rate of a latency-critical flow group: its share
+ * of the tenant's reservation, without the boost (see nvme_fg_boost_fp())
+ *
+ * Only the core owning the flow group writes the rate.
+ */
+static unsigned long nvme_fg_rate_fp(struct nvme_flow_group *fg) {
+    return token_rate_to_fp(fg->scaled_IOPS_limit * fg->share >>
+                            NVME_SHARE_SHIFT);
+}
+
+static inline unsigned long nvme_fg_boost_fp(struct nvme_flow_group *fg,
+                                             unsigned long boost) {
+    return boost * fg->share >> NVME_SHARE_SHIFT;
+}
+
+/*
+ * LC tenants by latency SLO in a min-heap, so the strictest SLO is known
+ * without scanning the tenants when one leaves. A shared tenant is in it
+ * once, with its own node. Protected by nvme_bitmap_lock.
+ */
+static struct nvme_slo_node *lc_slo_heap[MAX_NVME_FLOW_GROUPS];
+static int lc_slo_heap_len;
+static unsigned long global_num_lc_writers = 0;  // LC tenants with rw < 100
+
+static inline struct nvme_slo_node *lc_slo_node(struct nvme_flow_group *fg) {
+    return fg->tenant ? &fg->tenant->slo_node : &fg->slo_node;
+}
+
+static inline void lc_slo_heap_set(int i, struct nvme_slo_node *node) {
+    lc_slo_heap[i] = node;
+    node->heap_idx = i;
+}
+
+static void lc_slo_heap_fix(int i) {
+    struct nvme_slo_node *node = lc_slo_heap[i];
+    unsigned int slo = node->latency_us_SLO;
+    int c;
+
+    while (i > 0 && slo < lc_slo_heap[(i - 1) / 2]->latency_us_SLO) {
+        lc_slo_heap_set(i, lc_slo_heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
     }
+    while ((c = 2 * i + 1) < lc_slo_heap_len) {
+        if (c + 1 < lc_slo_heap_len &&
+            lc_slo_heap[c + 1]->latency_us_SLO < lc_slo_heap[c]->latency_us_SLO)
+            c++;
+        if (slo <= lc_slo_heap[c]->latency_us_SLO) break;
+        lc_slo_heap_set(i, lc_slo_heap[c]);
+        i = c;
+    }
+    lc_slo_heap_set(i, node);
 }
 
-int recalculate_weights_add(long new_flow_group_idx) {
-    unsigned long new_global_token_rate = 0;
-    unsigned long new_global_LC_sum_token_rate = 0;
+static void lc_slo_heap_add(struct nvme_flow_group *fg) {
+    struct nvme_slo_node *node = lc_slo_node(fg);
+
+    node->latency_us_SLO = fg->latency_us_SLO;
+    lc_slo_heap_set(lc_slo_heap_len++, node);
+    lc_slo_heap_fix(lc_slo_heap_len - 1);
+}
+
+static void lc_slo_heap_del(struct nvme_flow_group *fg) {
+    int i = lc_slo_node(fg)->heap_idx;
+
+    if (i == --lc_slo_heap_len) return;
+    lc_slo_heap_set(i, lc_slo_heap[lc_slo_heap_len]);
+    lc_slo_heap_fix(i);
+}
+
+static inline unsigned int lc_slo_strictest(void) {
+    return lc_slo_heap_len ? lc_slo_heap[0]->latency_us_SLO : UINT_MAX;
+}
+
+/*
+ * update_tenant_token_rates - redistribute global_token_rate to the tenants
+ *
+ * Best-effort tenants split what is left after the LC reservations in
+ * proportion to their weights; with no best-effort tenant registered the LC
+ * tenants get that share as a boost. Both are published as one word each
+ * that the schedulers read every round, and a tenant's own reservation is
+ * only written by its core, so a registration never touches other tenants.
+ * Called with nvme_bitmap_lock held whenever global_token_rate or the tenant
+ * mix changes.
+ */
+static void update_tenant_token_rates(void) {
+    unsigned long be_token_rate_per_weight;
     unsigned long lc_token_rate_boost_when_no_BE = 0;
-    unsigned int be_token_rate_per_tenant;
 
-    spin_lock(&nvme_bitmap_lock);
+    if (global_num_best_effort_tenants) {
+        be_token_rate_per_weight =
+            (global_token_rate - global_LC_sum_token_rate) /
+            global_be_weight_sum;
+        lc_token_rate_boost_when_no_BE = 0;
+    } else {
+        be_token_rate_per_weight = 0;
+        if (global_num_lc_tenants)
+            lc_token_rate_boost_when_no_BE =
+                (global_token_rate - global_LC_sum_token_rate) /
+                global_num_lc_tenants;
+    }
+    atomic_u64_write(&global_be_token_rate_per_weight,
+                     token_rate_to_fp(be_token_rate_per_weight));
+    // only boost LC tenants if no BE tenants registered
+    atomic_u64_write(&global_lc_boost_no_BE,
+                     token_rate_to_fp(lc_token_rate_boost_when_no_BE));
+
+    cp_shmem->nvme.token_rate = global_token_rate;
+}
+
+/*
+ * __recalculate_weights_add - account a tenant in the global rates
+ * Called with nvme_bitmap_lock held.
+ */
+static int __recalculate_weights_add(long new_flow_group_idx) {
+    unsigned long new_global_token_rate = 0;
+    unsigned long new_global_LC_sum_token_rate = 0;
 
     if (nvme_fgs[new_flow_group_idx].latency_critical_flag) {
         new_global_LC_sum_token_rate =
@@ -720,121 +1318,318 @@ int recalculate_weights_add(long new_flow_group_idx) {
             // tenant
             log_err("CANNOT SATISFY TENANT's SLO: %lu > %lu\n",
                     new_global_LC_sum_token_rate, new_global_token_rate);
-            spin_unlock(&nvme_bitmap_lock);
+            global_readonly_flag =
+                !global_num_best_effort_tenants && !global_num_lc_writers;
             return -RET_CANTMEETSLO;
         }
 
         global_token_rate = new_global_token_rate;
         global_LC_sum_token_rate = new_global_LC_sum_token_rate;
+        lc_slo_heap_add(&nvme_fgs[new_flow_group_idx]);
+        global_lat_SLO = lc_slo_strictest();
         printf("Global token rate: %lu tokens/s.\n", global_token_rate);
         global_num_lc_tenants++;
+        if (nvme_fgs[new_flow_group_idx].rw_ratio_SLO < 100)
+            global_num_lc_writers++;
     } else {
         global_num_best_effort_tenants++;
-        global_readonly_flag =
-            false;  // assume BE tenant has rd/wr mixed workload
+        global_be_weight_sum += nvme_fgs[new_flow_group_idx].be_weight;
     }
+    // assume BE tenants have rd/wr mixed workloads
+    global_readonly_flag =
+        !global_num_best_effort_tenants && !global_num_lc_writers;
 
-    if (global_num_best_effort_tenants) {
-        be_token_rate_per_tenant =
-            (global_token_rate - global_LC_sum_token_rate) /
-            global_num_best_effort_tenants;
-        lc_token_rate_boost_when_no_BE = 0;
-    } else {
-        be_token_rate_per_tenant = 0;
-        if (global_num_lc_tenants)
-            lc_token_rate_boost_when_no_BE =
-                (global_token_rate - global_LC_sum_token_rate) /
-                global_num_lc_tenants;
-    }
-    atomic_write(&global_be_token_rate_per_tenant, be_token_rate_per_tenant);
-
-    // if number of BE tenants has changes from 0 to 1 or more (or vice versa)
-    // adjust LC tenant boost (only want to boost if no BE tenants registered)
-    if (lc_token_rate_boost_when_no_BE != global_lc_boost_no_BE) {
-        global_lc_boost_no_BE = lc_token_rate_boost_when_no_BE;
-        readjust_lc_tenant_token_limits();
-    }
-    spin_unlock(&nvme_bitmap_lock);
+    update_tenant_token_rates();
 
     return 1;
 }
 
-int recalculate_weights_remove(long flow_group_idx) {
-    long i;
-    unsigned int strictest_latency_SLO = UINT_MAX;
-    unsigned int be_token_rate_per_tenant;
-    unsigned long lc_token_rate_boost_when_no_BE = 0;
+int recalculate_weights_add(long new_flow_group_idx) {
+    int ret;
 
     spin_lock(&nvme_bitmap_lock);
+    ret = __recalculate_weights_add(new_flow_group_idx);
+    spin_unlock(&nvme_bitmap_lock);
+
+    return ret;
+}
 
+/*
+ * __recalculate_weights_remove - take a tenant out of the global rates
+ * Called with nvme_bitmap_lock held.
+ */
+static void __recalculate_weights_remove(long flow_group_idx) {
     if (nvme_fgs[flow_group_idx].latency_critical_flag) {
-        // find new strictest latency SLO
-        global_readonly_flag = true;
-        for (i = 0; i < MAX_NVME_FLOW_GROUPS; i++) {
-            if (bitmap_test(nvme_fgs_bitmap, i) && i != flow_group_idx) {
-                if (nvme_fgs[i].latency_critical_flag) {
-                    if (nvme_fgs[i].latency_us_SLO < strictest_latency_SLO) {
-                        strictest_latency_SLO = nvme_fgs[i].latency_us_SLO;
-                    }
-                    if (nvme_fgs[i].rw_ratio_SLO < 100) {
-                        global_readonly_flag = false;
-                    }
-                }
-            }
-        }
+        lc_slo_heap_del(&nvme_fgs[flow_group_idx]);
+        global_lat_SLO = lc_slo_strictest();
+        if (nvme_fgs[flow_group_idx].rw_ratio_SLO < 100)
+            global_num_lc_writers--;
+        global_readonly_flag =
+            !global_num_best_effort_tenants && !global_num_lc_writers;
         global_LC_sum_token_rate -= nvme_fgs[flow_group_idx].scaled_IOPS_limit;
-        global_token_rate = lookup_device_token_rate(strictest_latency_SLO);
+        global_token_rate = lookup_device_token_rate(global_lat_SLO);
 
         printf("Global token rate: %lu tokens/s\n", global_token_rate);
 
         global_num_lc_tenants--;
     } else {
         global_num_best_effort_tenants--;
+        global_be_weight_sum -= nvme_fgs[flow_group_idx].be_weight;
+        global_readonly_flag =
+            !global_num_best_effort_tenants && !global_num_lc_writers;
     }
 
-    if (global_num_best_effort_tenants) {
-        global_readonly_flag = false;
-        be_token_rate_per_tenant =
-            (global_token_rate - global_LC_sum_token_rate) /
-            global_num_best_effort_tenants;
-        lc_token_rate_boost_when_no_BE = 0;
-    } else {
-        be_token_rate_per_tenant = 0;
-        if (global_num_lc_tenants)
-            lc_token_rate_boost_when_no_BE =
-                (global_token_rate - global_LC_sum_token_rate) /
-                global_num_lc_tenants;
-    }
-    atomic_write(&global_be_token_rate_per_tenant, be_token_rate_per_tenant);
-
-    // if number of BE tenants has changes from 0 to 1 or more (or vice versa)
-    // adjust LC tenant boost (only want to boost if no BE tenants registered)
-    if (lc_token_rate_boost_when_no_BE != global_lc_boost_no_BE) {
-        global_lc_boost_no_BE = lc_token_rate_boost_when_no_BE;
-        readjust_lc_tenant_token_limits();
-    }
+    update_tenant_token_rates();
+}
 
+int recalculate_weights_remove(long flow_group_idx) {
+    spin_lock(&nvme_bitmap_lock);
+    __recalculate_weights_remove(flow_group_idx);
     spin_unlock(&nvme_bitmap_lock);
 
     return 1;
 }
 
-// TODO: consider implementing separate per-thread lists for BE and LC tenants
-// (will simplify some code for scheduler)
-long bsys_nvme_register_flow(long flow_group_id, unsigned long cookie,
-                             unsigned int latency_us_SLO,
-                             unsigned long IOPS_SLO, int rw_ratio_SLO) {
-    long fg_handle = 0;
-    struct nvme_flow_group *nvme_fg;
-    int ret = 0;
-    int already_registered_flow = 0;
-    struct nvme_tenant_mgmt *thread_tenant_manager;
+// best-effort weight requested at registration, 0 for the default
+static inline unsigned int nvme_be_weight(unsigned int be_weight) {
+    return min(max(be_weight, 1u), NVME_MAX_BE_WEIGHT);
+}
+
+/*
+ * lc_heap_reserve - make room in the EDF heap for one more LC tenant
+ */
+static int lc_heap_reserve(struct nvme_tenant_mgmt *mgmt) {
+    struct nvme_sw_queue **heap;
+    int cap;
+
+    if (mgmt->num_lc_tenants < mgmt->lc_heap_cap) return 0;
+
+    cap = max(2 * mgmt->lc_heap_cap, 16);
+    heap = realloc(mgmt->lc_heap, cap * sizeof(*heap));
+    if (!heap) return -RET_NOMEM;
+
+    mgmt->lc_heap = heap;
+    mgmt->lc_heap_cap = cap;
+    return 0;
+}
+
+/*
+ * nvme_fg_set_share - schedule a flow group by a new share of its tenant
+ */
+static void nvme_fg_set_share(struct nvme_flow_group *fg, unsigned long share) {
+    struct nvme_tenant_mgmt *mgmt = &percpu_get(nvme_tenant_manager);
+    unsigned long weight = fg->be_weight * share;
+
+    fg->share = share;
+    if (fg->latency_critical_flag) {
+        fg->token_rate_fp = nvme_fg_rate_fp(fg);
+        return;
+    }
+    mgmt->be_weight += weight - fg->sched_weight;
+    if (fg->nvme_swq->backlogged)
+        mgmt->be_backlog_weight += weight - fg->sched_weight;
+    fg->sched_weight = weight;
+}
+
+/*
+ * nvme_fg_set_slo - the SLO a flow group is scheduled and accounted by
+ */
+static void nvme_fg_set_slo(struct nvme_flow_group *fg,
+                            unsigned int latency_us_SLO,
+                            unsigned long IOPS_SLO, int rw_ratio_SLO,
+                            unsigned int be_weight) {
+    fg->latency_us_SLO = latency_us_SLO;
+    fg->IOPS_SLO = IOPS_SLO;
+    fg->rw_ratio_SLO = rw_ratio_SLO;
+    fg->be_weight = latency_us_SLO ? 0 : nvme_be_weight(be_weight);
+    fg->latency_critical_flag = latency_us_SLO != 0;
+    fg->scaled_IOPS_limit = scaled_IOPS(IOPS_SLO, rw_ratio_SLO) / (double)1E6;
+}
+
+/*
+ * nvme_tenant_join - attach a new flow group to its shared tenant
+ *
+ * The SLO registered first holds for all of the tenant's connections. The
+ * first flow group accounts the tenant in the global rates, under the same
+ * lock, so a core joining meanwhile never sees a tenant that may still be
+ * refused. Returns 0, -RET_CANTMEETSLO, or -RET_NOMEM if there are too many
+ * shared tenants.
+ */
+static int nvme_tenant_join(long fg_handle, unsigned int latency_us_SLO,
+                            unsigned long IOPS_SLO, int rw_ratio_SLO,
+                            unsigned int be_weight) {
+    struct nvme_flow_group *fg = &nvme_fgs[fg_handle];
+    struct nvme_tenant *t, *unused = NULL;
+    int i, nr, ret;
+
+    spin_lock(&nvme_bitmap_lock);
+    for (i = 0; i < NVME_MAX_SHARED_TENANTS; i++) {
+        t = &nvme_tenants[i];
+        if (atomic_read(&t->nr_cores) == 0) {
+            if (!unused) unused = t;
+        } else if (t->flow_group_id == fg->flow_group_id) {
+            break;
+        }
+    }
+    if (i == NVME_MAX_SHARED_TENANTS) {
+        if (!unused) {
+            spin_unlock(&nvme_bitmap_lock);
+            log_err("error: exceeded max (%d) shared tenants!\n",
+                    NVME_MAX_SHARED_TENANTS);
+            return -RET_NOMEM;
+        }
+        t = unused;
+        t->flow_group_id = fg->flow_group_id;
+        t->latency_us_SLO = latency_us_SLO;
+        t->IOPS_SLO = IOPS_SLO;
+        t->rw_ratio_SLO = rw_ratio_SLO;
+        t->be_weight = nvme_be_weight(be_weight);
+        fg->tenant = t;
+        nvme_fg_set_slo(fg, latency_us_SLO, IOPS_SLO, rw_ratio_SLO, be_weight);
+        ret = __recalculate_weights_add(fg_handle);
+        if (ret < 0) {
+            fg->tenant = NULL;
+            spin_unlock(&nvme_bitmap_lock);
+            return ret;
+        }
+    } else {
+        if (t->latency_us_SLO != latency_us_SLO || t->IOPS_SLO != IOPS_SLO ||
+            t->rw_ratio_SLO != rw_ratio_SLO ||
+            (!latency_us_SLO && t->be_weight != nvme_be_weight(be_weight))) {
+            printf(
+                "WARNING: tenant %ld connection registered different SLO, "
+                "keeping the tenant's SLO. 1 SLO per tenant.\n",
+                fg->flow_group_id & ~NVME_FG_TENANT);
+        }
+        fg->tenant = t;
+        nvme_fg_set_slo(fg, t->latency_us_SLO, t->IOPS_SLO, t->rw_ratio_SLO,
+                        t->be_weight);
+    }
+    nr = atomic_add_and_fetch(&t->nr_cores, 1);
+    spin_unlock(&nvme_bitmap_lock);
+
+    // the other cores give up part of their share at their next rebalance
+    fg->share = NVME_SHARE_ONE / nr;
+    fg->demand = 0;
+    atomic_u64_write(&t->demand[percpu_get(cpu_nr)].tokens, 0);
+    list_add_tail(&percpu_get(nvme_tenant_manager).shared_fgs,
+                  &fg->tenant_link);
+    return 0;
+}
+
+/*
+ * nvme_tenant_leave - detach a flow group from its shared tenant
+ *
+ * The last one takes the tenant out of the global rates.
+ */
+static void nvme_tenant_leave(long fg_handle) {
+    struct nvme_flow_group *fg = &nvme_fgs[fg_handle];
+    struct nvme_tenant *t = fg->tenant;
+
+    list_del(&fg->tenant_link);
+    atomic_u64_write(&t->demand[percpu_get(cpu_nr)].tokens, 0);
+
+    spin_lock(&nvme_bitmap_lock);
+    if (atomic_sub_and_fetch(&t->nr_cores, 1) == 0)
+        __recalculate_weights_remove(fg_handle);
+    spin_unlock(&nvme_bitmap_lock);
+    fg->tenant = NULL;
+}
+
+/*
+ * nvme_fg_unaccount - undo the accounting of a flow group's registration
+ */
+static void nvme_fg_unaccount(long fg_handle) {
+    if (nvme_fgs[fg_handle].tenant)
+        nvme_tenant_leave(fg_handle);
+    else
+        recalculate_weights_remove(fg_handle);
+}
+
+/*
+ * nvme_fg_change_slo - overwrite the SLO of a live, unshared flow group
+ *
+ * The flow group keeps its slot, queue and connections. It is moved from the
+ * global rates and this core's scheduling state of its old SLO to those of
+ * the new one; if the new SLO can't be met the old one stays in place.
+ */
+static int nvme_fg_change_slo(long fg_handle, unsigned int latency_us_SLO,
+                              unsigned long IOPS_SLO, int rw_ratio_SLO,
+                              unsigned int be_weight) {
+    struct nvme_flow_group *fg = &nvme_fgs[fg_handle];
+    struct nvme_tenant_mgmt *mgmt = &percpu_get(nvme_tenant_manager);
+    struct nvme_sw_queue *swq = fg->nvme_swq;
+    unsigned int old_latency_us_SLO = fg->latency_us_SLO;
+    unsigned long old_IOPS_SLO = fg->IOPS_SLO;
+    int old_rw_ratio_SLO = fg->rw_ratio_SLO;
+    unsigned int old_be_weight = fg->be_weight;
+    bool was_lc = fg->latency_critical_flag;
+    int ret;
+
+    if (latency_us_SLO && !was_lc && lc_heap_reserve(mgmt))
+        return -RET_NOMEM;
+
+    // swap the SLO under one lock so no other core takes the freed rate
+    spin_lock(&nvme_bitmap_lock);
+    __recalculate_weights_remove(fg_handle);
+    nvme_fg_set_slo(fg, latency_us_SLO, IOPS_SLO, rw_ratio_SLO, be_weight);
+    ret = __recalculate_weights_add(fg_handle);
+    if (ret < 0) {
+        nvme_fg_set_slo(fg, old_latency_us_SLO, old_IOPS_SLO,
+                        old_rw_ratio_SLO, old_be_weight);
+        __recalculate_weights_add(fg_handle);
+    }
+    spin_unlock(&nvme_bitmap_lock);
+    if (ret < 0) return ret;
+
+    if (!was_lc) {
+        mgmt->num_best_effort_tenants--;
+        mgmt->be_weight -= fg->sched_weight;
+        if (swq->backlogged) {
+            list_del(&swq->list);
+            swq->backlogged = false;
+            mgmt->num_be_backlogged--;
+            mgmt->be_backlog_weight -= fg->sched_weight;
+        }
+    } else {
+        list_del(&swq->list);
+        mgmt->num_lc_tenants--;
+    }
+
+    fg->sched_weight = fg->be_weight * fg->share;
+    if (!fg->latency_critical_flag) {
+        mgmt->num_best_effort_tenants++;
+        mgmt->be_weight += fg->sched_weight;
+        if (!nvme_sw_queue_isempty(swq)) {
+            list_add_tail(&mgmt->be_backlog, &swq->list);
+            swq->backlogged = true;
+            mgmt->num_be_backlogged++;
+            mgmt->be_backlog_weight += fg->sched_weight;
+        }
+    } else {
+        fg->token_rate_fp = nvme_fg_rate_fp(fg);
+        list_add_tail(&mgmt->lc_tenants, &swq->list);
+        mgmt->num_lc_tenants++;
+    }
+    return 0;
+}
+
+long bsys_nvme_register_flow(long flow_group_id, unsigned long cookie,
+                             unsigned int latency_us_SLO,
+                             unsigned long IOPS_SLO, int rw_ratio_SLO,
+                             unsigned int be_weight) {
+    long fg_handle = 0;
+    struct nvme_flow_group *nvme_fg;
+    int ret = 0;
+    int already_registered_flow = 0;
+    struct nvme_tenant_mgmt *thread_tenant_manager;
     struct nvme_sw_queue *swq;
 
     already_registered_flow = set_nvme_flow_group_id(flow_group_id, &fg_handle);
-    if (fg_handle < 0) {
+    if (already_registered_flow < 0) {
         log_err("error: exceeded max (%d) nvme flow groups!\n",
                 MAX_NVME_FLOW_GROUPS);
+        return -RET_NOMEM;
     }
     // printf("fg_handle is %ld, already registered? %d\n", fg_handle, already_registered_flow);
 
@@ -853,45 +1648,89 @@ long bsys_nvme_register_flow(long flow_group_id, unsigned long cookie,
          */
         if ((nvme_fg->latency_us_SLO != latency_us_SLO) ||
             (nvme_fg->IOPS_SLO != IOPS_SLO) ||
-            (nvme_fg->rw_ratio_SLO != rw_ratio_SLO)) {
-            bsys_nvme_unregister_flow(fg_handle);
-            printf(
-                "WARNING: tenant connection registered different SLO, will "
-                "overwrite previous SLO for all of this tenant's connections. "
-                "1 SLO per tenant.\n");
+            (nvme_fg->rw_ratio_SLO != rw_ratio_SLO) ||
+            (!latency_us_SLO &&
+             nvme_fg->be_weight != nvme_be_weight(be_weight))) {
+            if (nvme_fg->tenant) {
+                // shared with other cores, which keep the first SLO
+                printf(
+                    "WARNING: tenant %ld connection registered different "
+                    "SLO, keeping the tenant's SLO. 1 SLO per tenant.\n",
+                    flow_group_id & ~NVME_FG_TENANT);
+            } else if (nvme_fg->conn_ref_count > 0) {
+                ret = nvme_fg_change_slo(fg_handle, latency_us_SLO, IOPS_SLO,
+                                         rw_ratio_SLO, be_weight);
+                if (ret < 0) {
+                    if (ret == -RET_CANTMEETSLO)
+                        printf("WARNING: cannot satisfy SLO\n");
+                    return ret;
+                }
+                printf(
+                    "WARNING: tenant connection registered different SLO, "
+                    "overwrote previous SLO for all of this tenant's "
+                    "connections. 1 SLO per tenant.\n");
+            }
+        }
+        // another connection of the tenant on this core shares its queue
+        if (nvme_fg->conn_ref_count > 0) {
+            nvme_fg->conn_ref_count++;
+            usys_nvme_registered_flow(fg_handle, cookie, RET_OK);
+            return RET_OK;
+        }
+        // the last connection went with the old SLO, take a new slot
+        if (set_nvme_flow_group_id(flow_group_id, &fg_handle) < 0) {
+            log_err("error: exceeded max (%d) nvme flow groups!\n",
+                    MAX_NVME_FLOW_GROUPS);
+            return -RET_NOMEM;
         }
+        nvme_fg = &nvme_fgs[fg_handle];
     }
-    nvme_fg->flow_group_id = flow_group_id;
+
+    nvme_fg->tenant = NULL;
+    nvme_fg->share = NVME_SHARE_ONE;
     nvme_fg->cookie = cookie;
-    nvme_fg->latency_us_SLO = latency_us_SLO;
-    nvme_fg->IOPS_SLO = IOPS_SLO;
-    nvme_fg->rw_ratio_SLO = rw_ratio_SLO;
-    nvme_fg->tid = RTE_PER_LCORE(cpu_nr);
-    nvme_fg->scaled_IOPS_limit =
-        scaled_IOPS(IOPS_SLO, rw_ratio_SLO) / (double)1E6;
-
-    if (latency_us_SLO == 0) {
-        nvme_fg->latency_critical_flag = false;
+    if (flow_group_id & NVME_FG_TENANT) {
+        ret = nvme_tenant_join(fg_handle, latency_us_SLO, IOPS_SLO,
+                               rw_ratio_SLO, be_weight);
+    } else {
+        nvme_fg_set_slo(nvme_fg, latency_us_SLO, IOPS_SLO, rw_ratio_SLO,
+                        be_weight);
+        ret = recalculate_weights_add(fg_handle);
+    }
+    if (ret < 0) {
+        if (ret == -RET_CANTMEETSLO) printf("WARNING: cannot satisfy SLO\n");
+        release_nvme_flow_group_id(fg_handle);
+        return ret;
+    }
+    nvme_fg->sched_weight = nvme_fg->be_weight * nvme_fg->share;
+
+    if (!nvme_fg->latency_critical_flag) {
         printf(
             "Register BE-tenant %ld (flow_group: %ld). Managed by thread %ld.\n"
             "IOPS_SLO: %lu, r/w %d, scaled_IOPS: %lu tokens/s, latency "
-            "SLO: %lu us. \n",
-            fg_handle, flow_group_id, RTE_PER_LCORE(cpu_nr), IOPS_SLO,
-            rw_ratio_SLO, nvme_fg->scaled_IOPS_limit, latency_us_SLO);
+            "SLO: %lu us, weight %u. \n",
+            fg_handle, flow_group_id, RTE_PER_LCORE(cpu_nr),
+            nvme_fg->IOPS_SLO, nvme_fg->rw_ratio_SLO,
+            nvme_fg->scaled_IOPS_limit, nvme_fg->latency_us_SLO,
+            nvme_fg->be_weight);
     } else {
-        nvme_fg->latency_critical_flag = true;
         printf(
             "Register LC-tenant %ld (flow_group: %ld). Managed by thread %ld.\n"
             "IOPS_SLO: %lu, r/w %d, scaled_IOPS: %lu tokens/s, latency "
             "SLO: %lu us. \n",
-            fg_handle, flow_group_id, RTE_PER_LCORE(cpu_nr), IOPS_SLO,
-            rw_ratio_SLO, nvme_fg->scaled_IOPS_limit, latency_us_SLO);
+            fg_handle, flow_group_id, RTE_PER_LCORE(cpu_nr),
+            nvme_fg->IOPS_SLO, nvme_fg->rw_ratio_SLO,
+            nvme_fg->scaled_IOPS_limit, nvme_fg->latency_us_SLO);
+        nvme_fg->token_rate_fp = nvme_fg_rate_fp(nvme_fg);
     }
 
-    ret = recalculate_weights_add(fg_handle);
-    if (ret < 0) {
-        printf("WARNING: cannot satisfy SLO\n");
-        return -RET_CANTMEETSLO;
+    thread_tenant_manager = &percpu_get(nvme_tenant_manager);
+    if (nvme_fg->latency_critical_flag &&
+        lc_heap_reserve(thread_tenant_manager)) {
+        log_err("error: can't grow LC tenant heap\n");
+        nvme_fg_unaccount(fg_handle);
+        release_nvme_flow_group_id(fg_handle);
+        return -RET_NOMEM;
     }
 
     // if (already_registered_flow == 0)
@@ -899,20 +1738,22 @@ long bsys_nvme_register_flow(long flow_group_id, unsigned long cookie,
     swq = alloc_local_nvme_swq();
     if (swq == NULL) {
         log_err("error: can't allocate nvme_swq for flow group\n");
+        nvme_fg_unaccount(fg_handle);
+        release_nvme_flow_group_id(fg_handle);
         return -RET_NOMEM;
     }
     nvme_fg->nvme_swq = swq;
     nvme_sw_queue_init(swq, fg_handle);
     // printf("swq %lx inited to fg_handle: %ld.\n", nvme_fg->nvme_swq, fg_handle);
-    thread_tenant_manager = &percpu_get(nvme_tenant_manager);
-    list_add(&thread_tenant_manager->tenant_swq, &swq->list);
     thread_tenant_manager->num_tenants++;
-    percpu_get(roundrobin_start) = 0;
-    nvme_fg->conn_ref_count = 0;
-    if (latency_us_SLO == 0) {
+    if (!nvme_fg->latency_critical_flag) {
         thread_tenant_manager->num_best_effort_tenants++;
+        thread_tenant_manager->be_weight += nvme_fg->sched_weight;
+    } else {
+        list_add_tail(&thread_tenant_manager->lc_tenants, &swq->list);
+        thread_tenant_manager->num_lc_tenants++;
     }
-    nvme_fg->conn_ref_count++;
+    nvme_fg->conn_ref_count = 1;
 
     usys_nvme_registered_flow(fg_handle, cookie, RET_OK);
 
@@ -927,15 +1768,22 @@ long bsys_nvme_unregister_flow(long fg_handle) {
         thread_tenant_manager = &percpu_get(nvme_tenant_manager);
         if (!nvme_fgs[fg_handle].latency_critical_flag) {
             thread_tenant_manager->num_best_effort_tenants--;
+            thread_tenant_manager->be_weight -=
+                nvme_fgs[fg_handle].sched_weight;
+            if (nvme_fgs[fg_handle].nvme_swq->backlogged) {
+                list_del(&nvme_fgs[fg_handle].nvme_swq->list);
+                thread_tenant_manager->num_be_backlogged--;
+                thread_tenant_manager->be_backlog_weight -=
+                    nvme_fgs[fg_handle].sched_weight;
+            }
+        } else {
+            list_del(&nvme_fgs[fg_handle].nvme_swq->list);
+            thread_tenant_manager->num_lc_tenants--;
         }
-        list_del(&nvme_fgs[fg_handle].nvme_swq->list);
         free_local_nvme_swq(nvme_fgs[fg_handle].nvme_swq);
         thread_tenant_manager->num_tenants--;
-        recalculate_weights_remove(fg_handle);
-
-        spin_lock(&nvme_bitmap_lock);
-        bitmap_clear(nvme_fgs_bitmap, fg_handle);
-        spin_unlock(&nvme_bitmap_lock);
+        nvme_fg_unaccount(fg_handle);
+        release_nvme_flow_group_id(fg_handle);
     }
 
     usys_nvme_unregistered_flow(fg_handle, RET_OK);
@@ -943,27 +1791,83 @@ long bsys_nvme_unregister_flow(long fg_handle) {
     return RET_OK;
 }
 
-// request cost scales linearly with size above 4KB
-// note: may need to adjust this if does not match your Flash device behavior
-static int nvme_compute_req_cost(int req_type, size_t req_len) {
-    if (req_len <= 0) {
-        printf("ERROR: request size <= 0!\n");
-        return 0;
-    }
+/*
+ * nvme_compute_req_cost - tokens charged for a request
+ *
+ * Costs are kept per opcode at power-of-two size classes from 512B and
+ * interpolated linearly inside a class, so the lookup is a handful of
+ * arithmetic instructions without branches. The last class extrapolates.
+ */
+static inline int nvme_compute_req_cost(int req_type, size_t req_len) {
+    unsigned long len = max(req_len, 1UL << NVME_COST_MIN_SHIFT);
+    int c = min(63 - __builtin_clzl(len) - NVME_COST_MIN_SHIFT,
+                NVME_COST_CLASSES - 1);
+
+    return nvme_cost_base[req_type][c] +
+           (((len - (1UL << (c + NVME_COST_MIN_SHIFT))) *
+             nvme_cost_slope[req_type][c]) >>
+            NVME_COST_FRAC_BITS);
+}
 
-    int len_scale_factor = 1;
+/*
+ * nvme_local_ns - namespace served by this core (NULL if emulated)
+ */
+static struct spdk_nvme_ns *nvme_local_ns(void) {
+    if (nvme_dev_model == EMULATED_FLASH) return NULL;
+    // FIXME: naive mapping from CPU to SSDs
+    return spdk_nvme_ctrlr_get_ns(
+        nvme_ctrlr[percpu_get(cpu_id) / cpu_per_ssd], global_ns_id);
+}
 
-    if (req_len > 4096) {
-        // divide req_len by 4096 and round up
-        len_scale_factor = (req_len + 4096 - 1) / 4096;
+/*
+ * nvme_sched_enqueue - queues ctx on its tenant's software queue
+ *
+ * Requests larger than nvme_max_cmd_size are queued as chunks that are
+ * charged and released to the device on their own, so a large request
+ * doesn't occupy the device in one piece; the application still gets a
+ * single completion. A best-effort tenant joins the core's round-robin
+ * ring when it becomes backlogged, so nvme_sched() only visits tenants
+ * with work.
+ */
+static int nvme_sched_enqueue(struct nvme_ctx *ctx) {
+    struct nvme_sw_queue *swq = nvme_fgs[ctx->fg_handle].nvme_swq;
+    struct nvme_tenant_mgmt *thread_tenant_manager;
+    struct nvme_ctx *chunk[NVME_STRIPE_MAX_CHILDREN];
+    int ret, n, i;
+
+    nvme_fgs[ctx->fg_handle].demand += ctx->req_cost;
+    if (nvme_fgs[ctx->fg_handle].latency_critical_flag)
+        ctx->deadline =
+            rdtsc() + (unsigned long)nvme_fgs[ctx->fg_handle].latency_us_SLO *
+                          cycles_per_us;
+
+    if (CFG.nvme_max_cmd_size && nvme_req_bytes(ctx) > CFG.nvme_max_cmd_size) {
+        n = nvme_split(ctx, CFG.nvme_max_cmd_size / global_ns_sector_size,
+                       chunk);
+        if (n < 0) return n;
+        if (nvme_sw_queue_reserve(swq, ctx->cmd, n)) {
+            for (i = 0; i < n; i++) free_local_nvme_ctx(chunk[i]);
+            return -EAGAIN;
+        }
+        for (i = 0; i < n; i++) {
+            chunk[i]->req_cost =
+                nvme_compute_req_cost(ctx->cmd, nvme_req_bytes(chunk[i]));
+            nvme_sw_queue_push_back(swq, chunk[i]);
+        }
+    } else {
+        ret = nvme_sw_queue_push_back(swq, ctx);
+        if (ret) return ret;
     }
 
-    if (req_type == NVME_CMD_READ) {
-        return NVME_READ_COST * len_scale_factor;
-    } else if (req_type == NVME_CMD_WRITE) {
-        return NVME_WRITE_COST * len_scale_factor;
+    if (!swq->backlogged && !nvme_fgs[ctx->fg_handle].latency_critical_flag) {
+        thread_tenant_manager = &percpu_get(nvme_tenant_manager);
+        list_add_tail(&thread_tenant_manager->be_backlog, &swq->list);
+        thread_tenant_manager->num_be_backlogged++;
+        thread_tenant_manager->be_backlog_weight +=
+            nvme_fgs[ctx->fg_handle].sched_weight;
+        swq->backlogged = true;
     }
-    return 1;
+    return 0;
 }
 
 long bsys_nvme_write(hqu_t fg_handle, void __user *__restrict vaddr,
@@ -974,9 +1878,7 @@ long bsys_nvme_write(hqu_t fg_handle, void __user *__restrict vaddr,
     void *paddr;
     int ret;
 
-    // FIXME: naive mapping from CPU to SSDs
-    ns = spdk_nvme_ctrlr_get_ns(nvme_ctrlr[percpu_get(cpu_id) / cpu_per_ssd],
-                                global_ns_id);
+    ns = nvme_local_ns();
     ctx = alloc_local_nvme_ctx();
     if (ctx == NULL) {
         printf(
@@ -996,31 +1898,29 @@ long bsys_nvme_write(hqu_t fg_handle, void __user *__restrict vaddr,
         */
     paddr = vaddr;
 
+    ctx->cmd = NVME_CMD_WRITE;
+    ctx->ns = ns;
+    ctx->qp_idx = 0;
+    ctx->paddr = paddr;
+    ctx->lba = lba;
+    ctx->lba_count = lba_count;
+    ctx->parent = NULL;
+    ctx->merge_head = NULL;
+    ctx->tid = RTE_PER_LCORE(cpu_nr);
+
     if (nvme_sched_flag) {
         // Store all info in ctx before add to software queue
-        ctx->tid = RTE_PER_LCORE(cpu_nr);
         ctx->fg_handle = fg_handle;
-        ctx->cmd = NVME_CMD_WRITE;
         ctx->req_cost = nvme_compute_req_cost(
             NVME_CMD_WRITE, lba_count * global_ns_sector_size);
-        ctx->ns = ns;
-        ctx->paddr = paddr;
-        ctx->lba = lba;
-        ctx->lba_count = lba_count;
-
-        // add to SW queue
-        // struct nvme_sw_queue swq = percpu_get(nvme_swq[ctx->priority]);
-        struct nvme_sw_queue *swq = nvme_fgs[fg_handle].nvme_swq;
-        ret = nvme_sw_queue_push_back(swq, ctx);
+
+        ret = nvme_sched_enqueue(ctx);
         if (ret != 0) {
             free_local_nvme_ctx(ctx);
             return -RET_NOMEM;
         }
     } else {
-        ret = spdk_nvme_ns_cmd_write(ns, percpu_get(qpair), paddr, lba,
-                                     lba_count, nvme_write_cb, ctx, 0);
-        if (ret != 0) printf("NVME Write ret: %lx\n", ret);
-        assert(ret == 0);
+        nvme_submit_or_defer(ctx);
     }
 
     return RET_OK;
@@ -1035,9 +1935,7 @@ long bsys_nvme_read(hqu_t fg_handle, void __user *__restrict vaddr,
     unsigned int ns_sector_size;
     int ret;
 
-    // FIXME: naive mapping from CPU to SSDs
-    ns = spdk_nvme_ctrlr_get_ns(nvme_ctrlr[percpu_get(cpu_id) / cpu_per_ssd],
-                                global_ns_id);
+    ns = nvme_local_ns();
 
     ctx = alloc_local_nvme_ctx();
     if (ctx == NULL) {
@@ -1058,32 +1956,30 @@ long bsys_nvme_read(hqu_t fg_handle, void __user *__restrict vaddr,
     paddr = vaddr;
 
     ctx->user_buf.buf = vaddr;
+    ctx->cmd = NVME_CMD_READ;
+    ctx->ns = ns;
+    ctx->qp_idx = 0;
+    ctx->paddr = paddr;
+    ctx->lba = lba;
+    ctx->lba_count = lba_count;
+    ctx->parent = NULL;
+    ctx->merge_head = NULL;
+    ctx->tid = RTE_PER_LCORE(cpu_nr);
 
     if (nvme_sched_flag) {
         // Store all info in ctx before add to software queue
-        ctx->tid = RTE_PER_LCORE(cpu_nr);
         ctx->fg_handle = fg_handle;
-        ctx->cmd = NVME_CMD_READ;
         ctx->req_cost = nvme_compute_req_cost(
             NVME_CMD_READ, lba_count * global_ns_sector_size);
-        ctx->ns = ns;
-        ctx->paddr = paddr;
-        ctx->lba = lba;
-        ctx->lba_count = lba_count;
 
-        // add to SW queue
-        struct nvme_sw_queue *swq = nvme_fgs[fg_handle].nvme_swq;
-        ret = nvme_sw_queue_push_back(swq, ctx);
+        ret = nvme_sched_enqueue(ctx);
         if (ret != 0) {
             free_local_nvme_ctx(ctx);
             return -RET_NOMEM;
         }
     } else {
         assert(((lba / lba_count) * lba_count) == lba);
-        ret = spdk_nvme_ns_cmd_read(ns, percpu_get(qpair), paddr, lba,
-                                    lba_count, nvme_read_cb, ctx, 0);
-        if (ret != 0) printf("NVME Read ret: %lx\n", ret);
-        assert(ret == 0);
+        nvme_submit_or_defer(ctx);
     }
 
     return RET_OK;
@@ -1092,7 +1988,10 @@ long bsys_nvme_read(hqu_t fg_handle, void __user *__restrict vaddr,
 static void sgl_reset_cb(void *cb_arg, uint32_t sgl_offset) {
     struct nvme_ctx *ctx = (struct nvme_ctx *)cb_arg;
 
+    // children of a split request may start in the middle of a page
+    sgl_offset += ctx->user_buf.sgl_buf.offset;
     ctx->user_buf.sgl_buf.current_sgl = sgl_offset / SGL_PAGE_SIZE;
+    ctx->user_buf.sgl_buf.current_offset = sgl_offset % SGL_PAGE_SIZE;
 }
 
 static int sgl_next_cb(void *cb_arg, uint64_t *address, uint32_t *length) {
@@ -1106,7 +2005,8 @@ static int sgl_next_cb(void *cb_arg, uint64_t *address, uint32_t *length) {
         printf("WARNING: nvme req size mismatch\n");
         assert(0);
     } else {
-        temp = ctx->user_buf.sgl_buf.sgl[ctx->user_buf.sgl_buf.current_sgl];
+        temp = ctx->user_buf.sgl_buf.sgl[ctx->user_buf.sgl_buf.current_sgl] +
+               ctx->user_buf.sgl_buf.current_offset;
         ctx->user_buf.sgl_buf.current_sgl++;
         /*
                 paddr = (void *) vm_lookup_phys(temp, PGSIZE_2MB);
@@ -1126,11 +2026,506 @@ static int sgl_next_cb(void *cb_arg, uint64_t *address, uint32_t *length) {
         // %d, handle %lu, tid %u\n", 	   temp, *address,
         // ctx->user_buf.sgl_buf.current_sgl -1, ctx->user_buf.sgl_buf.num_sgls,
         // ctx->handle, ctx->tid);
-        *length = 4096;  // PGSIZE_4KB
+        *length = SGL_PAGE_SIZE - ctx->user_buf.sgl_buf.current_offset;
+        ctx->user_buf.sgl_buf.current_offset = 0;
+    }
+    return 0;
+}
+
+/*
+ * sge_reset_cb/sge_next_cb - walk the sg_entry list of a request from
+ * bsys_nvme_writev_sg(); user_buf.sgl_buf.current_sgl and current_offset
+ * are the cursor (entry, byte offset)
+ */
+static void sge_reset_cb(void *cb_arg, uint32_t sgl_offset) {
+    struct sgl_buf *sgl = &((struct nvme_ctx *)cb_arg)->user_buf.sgl_buf;
+    int i = 0;
+
+    // children of a split request start at their byte offset
+    sgl_offset += sgl->offset;
+    while (i < sgl->num_sgls - 1 && sgl_offset >= sgl->ents[i].len) {
+        sgl_offset -= sgl->ents[i].len;
+        i++;
+    }
+    sgl->current_sgl = i;
+    sgl->current_offset = sgl_offset;
+}
+
+static int sge_next_cb(void *cb_arg, uint64_t *address, uint32_t *length) {
+    struct sgl_buf *sgl = &((struct nvme_ctx *)cb_arg)->user_buf.sgl_buf;
+    struct sg_entry *ent;
+
+    if (sgl->current_sgl >= sgl->num_sgls) {
+        *address = 0;
+        *length = 0;
+        printf("WARNING: nvme req size mismatch\n");
+        assert(0);
+        return 0;
+    }
+
+    ent = &sgl->ents[sgl->current_sgl++];
+    *address = (uint64_t)ent->base + sgl->current_offset;
+    *length = ent->len - sgl->current_offset;
+    sgl->current_offset = 0;
+    return 0;
+}
+
+/*
+ * merge_sgl_reset_cb/merge_sgl_next_cb - walk the buffers of the requests
+ * carried by a merged command; its merge_next and
+ * user_buf.sgl_buf.current_offset are the cursor (request, byte offset)
+ */
+static void merge_sgl_reset_cb(void *cb_arg, uint32_t sgl_offset) {
+    struct nvme_ctx *cmd = (struct nvme_ctx *)cb_arg;
+    struct nvme_ctx *ctx = cmd->merge_head;
+
+    while (ctx->merge_next && sgl_offset >= nvme_req_bytes(ctx)) {
+        sgl_offset -= nvme_req_bytes(ctx);
+        ctx = ctx->merge_next;
+    }
+    cmd->merge_next = ctx;
+    cmd->user_buf.sgl_buf.current_offset = sgl_offset;
+}
+
+static int merge_sgl_next_cb(void *cb_arg, uint64_t *address,
+                             uint32_t *length) {
+    struct nvme_ctx *cmd = (struct nvme_ctx *)cb_arg;
+    struct nvme_ctx *ctx = cmd->merge_next;
+    unsigned int off = cmd->user_buf.sgl_buf.current_offset;
+
+    if (ctx == NULL) {
+        *address = 0;
+        *length = 0;
+        printf("WARNING: nvme merged req size mismatch\n");
+        assert(0);
+        return 0;
+    }
+
+    // requests are page aligned (nvme_mergeable), so pages are never split
+    if (ctx->paddr) {
+        *address = (uint64_t)(ctx->paddr + off);
+        *length = nvme_req_bytes(ctx) - off;
+    } else {
+        *address = (uint64_t)(ctx->user_buf.sgl_buf.sgl[off / SGL_PAGE_SIZE] +
+                              off % SGL_PAGE_SIZE);
+        *length = SGL_PAGE_SIZE - off % SGL_PAGE_SIZE;
+    }
+
+    off += *length;
+    if (off >= nvme_req_bytes(ctx)) {
+        cmd->merge_next = ctx->merge_next;
+        off = 0;
+    }
+    cmd->user_buf.sgl_buf.current_offset = off;
+    return 0;
+}
+
+/*
+ * nvme_qpair_ns - namespace ns_id of the device behind the core's qpair
+ * (the first stripe member when striping, NULL if emulated)
+ */
+struct spdk_nvme_ns *nvme_qpair_ns(long ns_id) {
+    if (nvme_dev_model == EMULATED_FLASH) return NULL;
+    if (CFG.stripe_unit) return spdk_nvme_ctrlr_get_ns(stripe_ctrlr[0], ns_id);
+    return spdk_nvme_ctrlr_get_ns(
+        nvme_ctrlr[percpu_get(cpu_id) / cpu_per_ssd], ns_id);
+}
+
+/*
+ * nvme_qpair_at - the core's qpair with index idx (stripe member or 0)
+ */
+static inline struct spdk_nvme_qpair *nvme_qpair_at(int idx) {
+    if (CFG.stripe_unit) return percpu_get(stripe_qpair[idx]);
+    return percpu_get(qpair);
+}
+
+/*
+ * nvme_submit_cmd - submit a single command for ctx to a device
+ * uses PRP for a single buffer (ctx->paddr) and SGL otherwise
+ *
+ * Returns -ENOMEM without touching the device if the qpair is full.
+ */
+static int nvme_submit_cmd(struct nvme_ctx *ctx, struct spdk_nvme_ns *ns,
+                           int idx, unsigned long lba) {
+    struct spdk_nvme_qpair *qp;
+    spdk_nvme_req_reset_sgl_cb reset_sgl = sgl_reset_cb;
+    spdk_nvme_req_next_sge_cb next_sge = sgl_next_cb;
+    int ret;
+
+    if (percpu_get(qp_inflight[idx]) >= nvme_qp_depth) return -ENOMEM;
+
+    if (ctx->merge_head) {
+        reset_sgl = merge_sgl_reset_cb;
+        next_sge = merge_sgl_next_cb;
+    } else if (!ctx->paddr && ctx->user_buf.sgl_buf.ents) {
+        reset_sgl = sge_reset_cb;
+        next_sge = sge_next_cb;
+    }
+
+    qp = nvme_qpair_at(idx);
+    if (nvme_dev_model == EMULATED_FLASH) {
+        nvme_emu_submit(ctx);
+        ret = 0;
+    } else if (ctx->cmd == NVME_CMD_READ) {
+        if (ctx->paddr)
+            ret = spdk_nvme_ns_cmd_read(ns, qp, ctx->paddr, lba,
+                                        ctx->lba_count, nvme_read_cb, ctx, 0);
+        else
+            ret = spdk_nvme_ns_cmd_readv(ns, qp, lba, ctx->lba_count,
+                                         nvme_read_cb, ctx, 0, reset_sgl,
+                                         next_sge);
+    } else if (ctx->cmd == NVME_CMD_WRITE) {
+        if (ctx->paddr)
+            ret = spdk_nvme_ns_cmd_write(ns, qp, ctx->paddr, lba,
+                                         ctx->lba_count, nvme_write_cb, ctx,
+                                         0);
+        else
+            ret = spdk_nvme_ns_cmd_writev(ns, qp, lba, ctx->lba_count,
+                                          nvme_write_cb, ctx, 0, reset_sgl,
+                                          next_sge);
+    } else {
+        panic("unrecognized nvme request\n");
+    }
+
+    if (ret == 0) {
+        ctx->time = rdtsc();
+        ctx->qp_idx = idx;
+        percpu_get(qp_inflight[idx])++;
+        percpu_get(qp_unrung[idx])++;
     }
+    return ret;
+}
+
+/*
+ * nvme_poll_qpair - reaps completions of the core's qpair with index idx
+ *
+ * Commands are submitted with a delayed doorbell, so this also rings the
+ * SQ doorbell once for everything submitted since the last poll, i.e. a
+ * whole bsys_dispatch batch and nvme_sched() round.
+ */
+static int nvme_poll_qpair(int idx, int max_completions) {
+    if (percpu_get(qp_unrung[idx])) {
+        KSTATS_NVME_DOORBELL(percpu_get(qp_unrung[idx]));
+        percpu_get(qp_unrung[idx]) = 0;
+    }
+    if (nvme_dev_model == EMULATED_FLASH)
+        return nvme_emu_process_completions(max_completions);
+    return spdk_nvme_qpair_process_completions(nvme_qpair_at(idx),
+                                               max_completions);
+}
+
+/*
+ * nvme_stripe_map - map a logical lba to (member, member lba)
+ */
+static inline int nvme_stripe_map(unsigned long lba, unsigned long *dev_lba) {
+    unsigned long stripe = lba / stripe_unit_lbas;
+
+    *dev_lba =
+        (stripe / stripe_width) * stripe_unit_lbas + lba % stripe_unit_lbas;
+    return stripe % stripe_width;
+}
+
+static inline bool nvme_striped(void) {
+    return CFG.stripe_unit && nvme_dev_model != EMULATED_FLASH;
+}
+
+// end of the child of a split request that starts at lba
+static inline unsigned long nvme_split_next(unsigned long lba,
+                                            unsigned long end,
+                                            unsigned long max_lbas) {
+    end = min(end, lba + max_lbas);
+    if (nvme_striped())
+        end = min(end, (lba / stripe_unit_lbas + 1) * stripe_unit_lbas);
+    return end;
+}
+
+/*
+ * nvme_split - split a request into children of at most max_lbas that each
+ * stay within one stripe unit and are mapped to their device
+ *
+ * Children complete the parent when the last one finishes. They are
+ * allocated up front so a failed allocation leaves the parent untouched.
+ * Returns the number of children.
+ */
+static int nvme_split(struct nvme_ctx *ctx, unsigned long max_lbas,
+                      struct nvme_ctx **child) {
+    struct sgl_buf *sgl = &ctx->user_buf.sgl_buf;
+    unsigned long lba, end, next, off;
+    int member, n = 0, i;
+
+    end = ctx->lba + ctx->lba_count;
+    for (lba = ctx->lba; lba < end; lba = nvme_split_next(lba, end, max_lbas))
+        n++;
+    if (n > NVME_STRIPE_MAX_CHILDREN) return -RET_INVAL;
+    for (i = 0; i < n; i++) {
+        child[i] = alloc_local_nvme_ctx();
+        if (child[i] == NULL) {
+            while (i--) free_local_nvme_ctx(child[i]);
+            return -RET_NOMEM;
+        }
+    }
+
+    lba = ctx->lba;
+    for (i = 0; i < n; i++) {
+        next = nvme_split_next(lba, end, max_lbas);
+        off = (lba - ctx->lba) * global_ns_sector_size;
+        child[i]->cookie = ctx->cookie;
+        child[i]->tid = ctx->tid;
+        child[i]->fg_handle = ctx->fg_handle;
+        child[i]->cmd = ctx->cmd;
+        child[i]->req_cost = 0;
+        child[i]->deadline = ctx->deadline;
+        child[i]->lba_count = next - lba;
+        child[i]->parent = ctx;
+        child[i]->merge_head = NULL;
+        if (ctx->paddr) {
+            child[i]->paddr = ctx->paddr + off;
+        } else if (sgl->ents) {
+            // entries are walked from the start by sge_reset_cb
+            child[i]->paddr = NULL;
+            child[i]->user_buf.sgl_buf.sgl = NULL;
+            child[i]->user_buf.sgl_buf.ents = sgl->ents;
+            child[i]->user_buf.sgl_buf.num_sgls = sgl->num_sgls;
+            child[i]->user_buf.sgl_buf.offset = sgl->offset + off;
+        } else {
+            off += sgl->offset;
+            child[i]->paddr = NULL;
+            child[i]->user_buf.sgl_buf.ents = NULL;
+            child[i]->user_buf.sgl_buf.sgl = sgl->sgl + off / SGL_PAGE_SIZE;
+            child[i]->user_buf.sgl_buf.num_sgls =
+                sgl->num_sgls - off / SGL_PAGE_SIZE;
+            child[i]->user_buf.sgl_buf.offset = off % SGL_PAGE_SIZE;
+        }
+        if (nvme_striped()) {
+            member = nvme_stripe_map(lba, &child[i]->lba);
+            child[i]->ns = stripe_ns[member];
+            child[i]->qp_idx = member;
+        } else {
+            child[i]->lba = lba;
+            child[i]->ns = ctx->ns;
+            child[i]->qp_idx = 0;
+        }
+        lba = next;
+    }
+
+    ctx->stripe_pending = n;
+    return n;
+}
+
+/*
+ * nvme_stripe_submit - submit a request to a striped volume
+ *
+ * A request within one stripe unit goes straight to its member, others are
+ * split at stripe unit boundaries. Once split, children that find their
+ * qpair full are deferred on their own.
+ */
+static int nvme_stripe_submit(struct nvme_ctx *ctx) {
+    struct nvme_ctx *child[NVME_STRIPE_MAX_CHILDREN];
+    unsigned long dev_lba;
+    int member, n, i;
+
+    member = nvme_stripe_map(ctx->lba, &dev_lba);
+    if (ctx->lba / stripe_unit_lbas ==
+        (ctx->lba + ctx->lba_count - 1) / stripe_unit_lbas)
+        return nvme_submit_cmd(ctx, stripe_ns[member], member, dev_lba);
+
+    n = nvme_split(ctx, ctx->lba_count, child);
+    if (n < 0) return n;
+    for (i = 0; i < n; i++) nvme_submit_or_defer(child[i]);
     return 0;
 }
 
+/*
+ * nvme_submit - submit a request to its device or across the stripe
+ */
+static int nvme_submit(struct nvme_ctx *ctx) {
+    // a child of a split request already targets a single member
+    if (ctx->parent)
+        return nvme_submit_cmd(ctx, ctx->ns, ctx->qp_idx, ctx->lba);
+    if (nvme_striped()) return nvme_stripe_submit(ctx);
+    return nvme_submit_cmd(ctx, ctx->ns, 0, ctx->lba);
+}
+
+static inline bool nvme_submit_retriable(int ret) {
+    return ret == -ENOMEM || ret == -RET_NOMEM;
+}
+
+/*
+ * nvme_submit_failed - complete a request that the device refused
+ */
+static void nvme_submit_failed(struct nvme_ctx *ctx, int ret) {
+    printf("Error submitting nvme request: %d\n", ret);
+    nvme_complete(ctx, -RET_INVAL);
+}
+
+/*
+ * nvme_submit_or_defer - submit a request, or park it on the core's
+ * deferred list if its qpair is full
+ *
+ * Deferred requests are resubmitted in order by nvme_retry_deferred() as
+ * completions free up the qpair, and new requests queue up behind them.
+ */
+static void nvme_submit_or_defer(struct nvme_ctx *ctx) {
+    int ret;
+
+    if (list_empty(&percpu_get(nvme_deferred))) {
+        ret = nvme_submit(ctx);
+        if (ret == 0) return;
+        if (!nvme_submit_retriable(ret)) {
+            nvme_submit_failed(ctx, ret);
+            return;
+        }
+    }
+    list_add_tail(&percpu_get(nvme_deferred), &ctx->link);
+}
+
+/*
+ * nvme_retry_deferred - resubmit deferred requests until a qpair fills up
+ */
+static void nvme_retry_deferred(void) {
+    struct nvme_ctx *ctx;
+    int ret;
+
+    while ((ctx = list_top(&percpu_get(nvme_deferred), struct nvme_ctx,
+                           link))) {
+        list_del(&ctx->link);
+        ret = nvme_submit(ctx);
+        if (ret == 0) continue;
+        if (nvme_submit_retriable(ret)) {
+            list_add(&percpu_get(nvme_deferred), &ctx->link);
+            return;
+        }
+        nvme_submit_failed(ctx, ret);
+    }
+}
+
+/*
+ * Request merging: contiguous requests of a tenant that the scheduler issues
+ * back to back are staged and sent as one command of at most
+ * CFG.nvme_merge_size bytes, then completed one by one. Tokens have already
+ * been charged per request when they were dequeued.
+ */
+
+/*
+ * nvme_mergeable - a request can be carried by a merged command if its
+ * buffer starts and ends on a page boundary, so the merged SGL also maps
+ * to PRPs
+ */
+static inline bool nvme_mergeable(struct nvme_ctx *ctx) {
+    if (ctx->parent || nvme_req_bytes(ctx) % SGL_PAGE_SIZE) return false;
+    if (ctx->paddr) return (uintptr_t)ctx->paddr % SGL_PAGE_SIZE == 0;
+    return !ctx->user_buf.sgl_buf.ents && ctx->user_buf.sgl_buf.offset == 0 &&
+           (uintptr_t)ctx->user_buf.sgl_buf.sgl[0] % SGL_PAGE_SIZE == 0;
+}
+
+static bool nvme_merge_extends(struct nvme_ctx *ctx) {
+    struct nvme_ctx *first = percpu_get(merge_first);
+    struct nvme_ctx *last = percpu_get(merge_last);
+    unsigned long end = ctx->lba + ctx->lba_count;
+
+    if (ctx->fg_handle != last->fg_handle || ctx->cmd != last->cmd ||
+        ctx->ns != last->ns || ctx->lba != last->lba + last->lba_count ||
+        !nvme_mergeable(ctx))
+        return false;
+    if ((percpu_get(merge_lbas) + ctx->lba_count) * global_ns_sector_size >
+        CFG.nvme_merge_size)
+        return false;
+    // a merged command goes to a single stripe member
+    return !CFG.stripe_unit ||
+           first->lba / stripe_unit_lbas == (end - 1) / stripe_unit_lbas;
+}
+
+/*
+ * nvme_merge_flush - submit the staged requests, as one command if possible
+ */
+static void nvme_merge_flush(void) {
+    struct nvme_ctx *first = percpu_get(merge_first);
+    struct nvme_ctx *cmd, *next;
+
+    if (!first) return;
+    percpu_get(merge_first) = NULL;
+
+    cmd = first->merge_next ? alloc_local_nvme_ctx() : NULL;
+    if (cmd == NULL) {
+        for (; first; first = next) {
+            next = first->merge_next;
+            nvme_submit_or_defer(first);
+        }
+        return;
+    }
+
+    cmd->cookie = 0;
+    cmd->tid = first->tid;
+    cmd->fg_handle = first->fg_handle;
+    cmd->cmd = first->cmd;
+    cmd->req_cost = 0;
+    cmd->ns = first->ns;
+    cmd->qp_idx = 0;
+    cmd->paddr = NULL;
+    cmd->lba = first->lba;
+    cmd->lba_count = percpu_get(merge_lbas);
+    cmd->parent = NULL;
+    cmd->merge_head = first;
+    cmd->merge_next = NULL;
+    nvme_submit_or_defer(cmd);
+}
+
+/*
+ * nvme_merge_stage - issue a scheduled request, merging it with the
+ * previous one if it continues it
+ */
+static void nvme_merge_stage(struct nvme_ctx *ctx) {
+    ctx->merge_next = NULL;
+    if (percpu_get(merge_first) && nvme_merge_extends(ctx)) {
+        percpu_get(merge_last)->merge_next = ctx;
+        percpu_get(merge_last) = ctx;
+        percpu_get(merge_lbas) += ctx->lba_count;
+        return;
+    }
+
+    nvme_merge_flush();
+    if (!nvme_mergeable(ctx)) {
+        nvme_submit_or_defer(ctx);
+        return;
+    }
+    percpu_get(merge_first) = ctx;
+    percpu_get(merge_last) = ctx;
+    percpu_get(merge_lbas) = ctx->lba_count;
+}
+
+/*
+ * nvme_merge_complete - complete every request carried by a merged command
+ */
+static void nvme_merge_complete(struct nvme_ctx *cmd, int ret) {
+    struct nvme_ctx *ctx, *next;
+
+    for (ctx = cmd->merge_head; ctx; ctx = next) {
+        next = ctx->merge_next;
+        if (ctx->cmd == NVME_CMD_READ)
+            usys_nvme_response(ctx->cookie, ctx->user_buf.buf, ret);
+        else
+            usys_nvme_written(ctx->cookie, ret);
+        free_local_nvme_ctx(ctx);
+    }
+    free_local_nvme_ctx(cmd);
+}
+
+/*
+ * nvme_sgl_contig - returns the start of the buffer if the SGL pages are
+ * virtually contiguous, NULL otherwise
+ *
+ * Contiguous requests (always the case for a single page) are issued with
+ * PRPs, which avoids the per-page sgl_reset_cb/sgl_next_cb callbacks.
+ */
+static void *nvme_sgl_contig(void **sgl, int num_sgls) {
+    int i;
+
+    if (num_sgls <= 0 || (uintptr_t)sgl[0] % SGL_PAGE_SIZE) return NULL;
+    for (i = 1; i < num_sgls; i++)
+        if (sgl[i] != sgl[i - 1] + SGL_PAGE_SIZE) return NULL;
+    return sgl[0];
+}
+
 long bsys_nvme_writev(hqu_t fg_handle, void __user **__restrict buf,
                       int num_sgls, unsigned long lba, unsigned int lba_count,
                       unsigned long cookie) {
@@ -1138,9 +2533,7 @@ long bsys_nvme_writev(hqu_t fg_handle, void __user **__restrict buf,
     struct nvme_ctx *ctx;
     int ret;
 
-    // FIXME: naive mapping from CPU to SSDs
-    ns = spdk_nvme_ctrlr_get_ns(nvme_ctrlr[percpu_get(cpu_id) / cpu_per_ssd],
-                                global_ns_id);
+    ns = nvme_local_ns();
 
     ctx = alloc_local_nvme_ctx();
     if (ctx == NULL) {
@@ -1150,33 +2543,32 @@ long bsys_nvme_writev(hqu_t fg_handle, void __user **__restrict buf,
     }
     ctx->cookie = cookie;
     ctx->user_buf.sgl_buf.sgl = buf;
+    ctx->user_buf.sgl_buf.ents = NULL;
     ctx->user_buf.sgl_buf.num_sgls = num_sgls;
+    ctx->user_buf.sgl_buf.offset = 0;
+    ctx->cmd = NVME_CMD_WRITE;
+    ctx->ns = ns;
+    ctx->qp_idx = 0;
+    ctx->paddr = nvme_sgl_contig(buf, num_sgls);
+    ctx->lba = lba;
+    ctx->lba_count = lba_count;
+    ctx->parent = NULL;
+    ctx->merge_head = NULL;
+    ctx->tid = percpu_get(cpu_nr);
 
     if (nvme_sched_flag) {
         // Store all info in ctx before add to software queue
-        ctx->tid = percpu_get(cpu_nr);
         ctx->fg_handle = fg_handle;
-        ctx->cmd = NVME_CMD_WRITE;
         ctx->req_cost = nvme_compute_req_cost(
             NVME_CMD_WRITE, lba_count * global_ns_sector_size);
-        ctx->ns = ns;
-        ctx->lba = lba;
-        ctx->lba_count = lba_count;
 
-        // add to SW queue
-        struct nvme_sw_queue *swq = nvme_fgs[fg_handle].nvme_swq;
-        ret = nvme_sw_queue_push_back(swq, ctx);
+        ret = nvme_sched_enqueue(ctx);
         if (ret != 0) {
             free_local_nvme_ctx(ctx);
             return -RET_NOMEM;
         }
     } else {
-        ret = spdk_nvme_ns_cmd_writev(ns, percpu_get(qpair), lba, lba_count,
-                                      nvme_write_cb, ctx, 0, sgl_reset_cb,
-                                      sgl_next_cb);
-        if (ret != 0)
-            printf("Writev failed: %lx %lx %lx\n", ret, num_sgls, lba_count);
-        assert(ret == 0);
+        nvme_submit_or_defer(ctx);
     }
 
     return RET_OK;
@@ -1189,9 +2581,7 @@ long bsys_nvme_readv(hqu_t fg_handle, void __user **__restrict buf,
     struct nvme_ctx *ctx;
     int ret;
 
-    // FIXME: naive mapping from CPU to SSDs
-    ns = spdk_nvme_ctrlr_get_ns(nvme_ctrlr[percpu_get(cpu_id) / cpu_per_ssd],
-                                global_ns_id);
+    ns = nvme_local_ns();
 
     ctx = alloc_local_nvme_ctx();
     if (ctx == NULL) {
@@ -1201,65 +2591,181 @@ long bsys_nvme_readv(hqu_t fg_handle, void __user **__restrict buf,
     }
     ctx->cookie = cookie;
     ctx->user_buf.sgl_buf.sgl = buf;
+    ctx->user_buf.sgl_buf.ents = NULL;
     ctx->user_buf.sgl_buf.num_sgls = num_sgls;
+    ctx->user_buf.sgl_buf.offset = 0;
+    ctx->cmd = NVME_CMD_READ;
+    ctx->ns = ns;
+    ctx->qp_idx = 0;
+    ctx->paddr = nvme_sgl_contig(buf, num_sgls);
+    ctx->lba = lba;
+    ctx->lba_count = lba_count;
+    ctx->parent = NULL;
+    ctx->merge_head = NULL;
+    ctx->tid = RTE_PER_LCORE(cpu_nr);
 
     if (nvme_sched_flag) {
         // Store all info in ctx before add to software queue
-        ctx->tid = RTE_PER_LCORE(cpu_nr);
         ctx->fg_handle = fg_handle;
-        ctx->cmd = NVME_CMD_READ;
         ctx->req_cost = nvme_compute_req_cost(
             NVME_CMD_READ, lba_count * global_ns_sector_size);
-        ctx->ns = ns;
-        ctx->lba = lba;
-        ctx->lba_count = lba_count;
 
-        // add to SW queue
-        struct nvme_sw_queue *swq = nvme_fgs[fg_handle].nvme_swq;
-        // printf("swq %lx accessed from fg_handle: %ld", swq, fg_handle);
-        ret = nvme_sw_queue_push_back(swq, ctx);
+        ret = nvme_sched_enqueue(ctx);
         if (ret != 0) {
             free_local_nvme_ctx(ctx);
             printf("returning NOMEM from readv\n");
             return -RET_NOMEM;
         }
     } else {
-        ret = spdk_nvme_ns_cmd_readv(ns, percpu_get(qpair), lba, lba_count,
-                                     nvme_read_cb, ctx, 0, sgl_reset_cb,
-                                     sgl_next_cb);
-        if (ret != 0)
-            printf("Readv failed: %lx %lx %lx\n", ret, num_sgls, lba_count);
-        assert(ret == 0);
+        nvme_submit_or_defer(ctx);
     }
 
     return RET_OK;
 }
 
-unsigned long try_acquire_global_tokens(unsigned long token_demand) {
-    unsigned long new_token_level = 0;
-    unsigned long avail_tokens = 0;
+/*
+ * nvme_sg_valid - the queue can take a write from this sg_entry list
+ */
+static bool nvme_sg_valid(struct sg_entry *ents, int nrents,
+                          unsigned int lba_count) {
+    unsigned long len = 0;
+    int i;
 
-    while (1) {
-        avail_tokens = atomic_u64_read(&global_leftover_tokens);
+    if (!(global_ns_open_flags & NVME_OPEN_SG_ENTRIES) || nrents <= 0 ||
+        nrents > NVME_MAX_SG_ENTRIES)
+        return false;
+    for (i = 0; i < nrents; i++) {
+        if ((global_ns_open_flags & NVME_OPEN_SG_DWORD) &&
+            (((uintptr_t)ents[i].base | ents[i].len) & 3))
+            return false;
+        len += ents[i].len;
+    }
+    return len == lba_count * global_ns_sector_size;
+}
 
-        if (token_demand > avail_tokens) {
-            if (atomic_u64_cmpxchg(&global_leftover_tokens, avail_tokens, 0)) {
-                return avail_tokens;
-            }
+long bsys_nvme_writev_sg(hqu_t fg_handle, struct sg_entry __user *ents,
+                         int nrents, unsigned long lba, unsigned int lba_count,
+                         unsigned long cookie) {
+    struct nvme_ctx *ctx;
+    int ret;
 
-        } else {
-            new_token_level = avail_tokens - token_demand;
-            if (atomic_u64_cmpxchg(&global_leftover_tokens, avail_tokens,
-                                   new_token_level)) {
-                return token_demand;
-            }
+    if (!nvme_sg_valid(ents, nrents, lba_count)) {
+        log_err("nvme: invalid sg_entry list for writev_sg\n");
+        return -RET_INVAL;
+    }
+
+    ctx = alloc_local_nvme_ctx();
+    if (ctx == NULL) {
+        printf(
+            "ERROR: Cannot allocate memory for nvme_ctx in "
+            "bsys_nvme_writev_sg\n");
+        return -RET_NOMEM;
+    }
+    ctx->cookie = cookie;
+    ctx->user_buf.sgl_buf.sgl = NULL;
+    ctx->user_buf.sgl_buf.ents = ents;
+    ctx->user_buf.sgl_buf.num_sgls = nrents;
+    ctx->user_buf.sgl_buf.offset = 0;
+    ctx->cmd = NVME_CMD_WRITE;
+    ctx->ns = nvme_local_ns();
+    ctx->qp_idx = 0;
+    ctx->paddr = NULL;
+    ctx->lba = lba;
+    ctx->lba_count = lba_count;
+    ctx->parent = NULL;
+    ctx->merge_head = NULL;
+    ctx->tid = percpu_get(cpu_nr);
+
+    if (nvme_sched_flag) {
+        ctx->fg_handle = fg_handle;
+        ctx->req_cost = nvme_compute_req_cost(
+            NVME_CMD_WRITE, lba_count * global_ns_sector_size);
+
+        ret = nvme_sched_enqueue(ctx);
+        if (ret != 0) {
+            free_local_nvme_ctx(ctx);
+            return -RET_NOMEM;
         }
+    } else {
+        nvme_submit_or_defer(ctx);
     }
+
+    return RET_OK;
 }
 
-static void issue_nvme_req(struct nvme_ctx *ctx) {
-    int ret;
+static inline unsigned long current_token_epoch(void) {
+    return atomic_u64_read(&token_epoch) >> NVME_EPOCH_SHIFT;
+}
+
+/*
+ * donate_leftover_tokens - add tokens to this core's leftover slot
+ */
+static void donate_leftover_tokens(unsigned long tokens) {
+    atomic_u64_t *slot = &leftover_slots[percpu_get(cpu_nr)].word;
+    unsigned long epoch = current_token_epoch();
+    unsigned long old, avail;
+
+    do {
+        old = atomic_u64_read(slot);
+        avail = (old >> NVME_EPOCH_SHIFT) == epoch ? old & NVME_EPOCH_LOW : 0;
+        avail = min(avail + tokens, NVME_EPOCH_LOW);
+    } while (!atomic_u64_cmpxchg(slot, old, epoch << NVME_EPOCH_SHIFT | avail));
+}
+
+static unsigned long take_slot_tokens(atomic_u64_t *slot, unsigned long epoch,
+                                      unsigned long token_demand) {
+    unsigned long old, take;
+
+    do {
+        old = atomic_u64_read(slot);
+        if ((old >> NVME_EPOCH_SHIFT) != epoch || !(old & NVME_EPOCH_LOW))
+            return 0;
+        take = min(old & NVME_EPOCH_LOW, token_demand);
+    } while (!atomic_u64_cmpxchg(slot, old, old - take));
+
+    return take;
+}
+
+/*
+ * try_acquire_global_tokens - collect up to token_demand leftover tokens
+ *
+ * Starts with this core's own slot and walks the others from there; empty
+ * or expired slots are only read, never written.
+ */
+unsigned long try_acquire_global_tokens(unsigned long token_demand) {
+    unsigned long epoch = current_token_epoch();
+    unsigned long acquired = 0;
+    atomic_u64_t *slot;
+    int i, cpu = percpu_get(cpu_nr);
+
+    for (i = 0; i < cpus_active && acquired < token_demand; i++) {
+        slot = &leftover_slots[(cpu + i) % cpus_active].word;
+        acquired += take_slot_tokens(slot, epoch, token_demand - acquired);
+    }
+
+    return acquired;
+}
 
+/*
+ * lc_heap_sift_down - restore the min-heap on head deadline below heap[i]
+ */
+static void lc_heap_sift_down(struct nvme_sw_queue **heap, int n, int i) {
+    struct nvme_sw_queue *swq = heap[i];
+    unsigned long deadline = nvme_sw_queue_head_deadline(swq);
+    int c;
+
+    while ((c = 2 * i + 1) < n) {
+        if (c + 1 < n && nvme_sw_queue_head_deadline(heap[c + 1]) <
+                             nvme_sw_queue_head_deadline(heap[c]))
+            c++;
+        if (deadline <= nvme_sw_queue_head_deadline(heap[c])) break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = swq;
+}
+
+static void issue_nvme_req(struct nvme_ctx *ctx) {
     // don't schedule request on flash if FAKE_FLASH test
     if (nvme_dev_model == FAKE_FLASH) {
         if (ctx->cmd == NVME_CMD_READ) {
@@ -1274,110 +2780,263 @@ static void issue_nvme_req(struct nvme_ctx *ctx) {
         return;
     }
 
-    if (ctx->cmd == NVME_CMD_READ) {
-        // if PRP:
-        // ret = spdk_nvme_ns_cmd_read(ctx->ns, percpu_get(qpair), ctx->paddr,
-        // ctx->lba, ctx->lba_count, nvme_read_cb, ctx, 0);
-        // for SGL:
-        ret = spdk_nvme_ns_cmd_readv(ctx->ns, percpu_get(qpair), ctx->lba,
-                                     ctx->lba_count, nvme_read_cb, ctx, 0,
-                                     sgl_reset_cb, sgl_next_cb);
+    if (CFG.nvme_merge_size)
+        nvme_merge_stage(ctx);
+    else
+        nvme_submit_or_defer(ctx);
+}
 
-    } else if (ctx->cmd == NVME_CMD_WRITE) {
-        // if PRP:
-        // ret = spdk_nvme_ns_cmd_write(ctx->ns, percpu_get(qpair), ctx->paddr,
-        // ctx->lba, ctx->lba_count, nvme_write_cb, ctx, 0);
-        // for SGL:
-        ret = spdk_nvme_ns_cmd_writev(ctx->ns, percpu_get(qpair), ctx->lba,
-                                      ctx->lba_count, nvme_write_cb, ctx, 0,
-                                      sgl_reset_cb, sgl_next_cb);
+/*
+ * Work stealing: a core whose best-effort tenants queue more than its
+ * tokens cover offers a batch of their requests in its steal ring while
+ * other cores are idle. Those spend their spare tokens on the requests and
+ * submit them on their own qpair; the completions go back to the owner, see
+ * nvme_complete(). The owner is the only producer of its ring, consumers
+ * claim entries by advancing the tail with cmpxchg. Only cores on the same
+ * device steal from each other, and striped volumes don't steal because
+ * their children are allocated by the submitting core.
+ */
+#define NVME_STEAL_BATCH 16
 
-    } else {
-        panic("unrecognized nvme request\n");
-    }
-    if (ret < 0) {
-        printf("Error submitting nvme request\n");
-        panic("Ran out of NVMe cmd buffer space\n");
+struct nvme_steal_ring {
+    struct nvme_ctx *buf[NVME_STEAL_BATCH];
+    volatile unsigned long head;  // written by the owner only
+    atomic_u64_t tail __aligned(CACHE_LINE_SIZE);
+} __aligned(CACHE_LINE_SIZE);
+
+static struct nvme_steal_ring steal_rings[MAX_NUM_THREADS];
+static atomic_t steal_idle_cores = ATOMIC_INIT(0);
+
+static inline bool nvme_steal_enabled(void) {
+    return nvme_dev_model != FAKE_FLASH && !nvme_striped();
+}
+
+/*
+ * nvme_steal_set_idle - tell the other cores whether this core has spare
+ * capacity; the shared counter is only written when that changes
+ */
+static inline void nvme_steal_set_idle(bool idle) {
+    if (percpu_get(steal_idle) == idle) return;
+    percpu_get(steal_idle) = idle;
+    if (idle)
+        atomic_inc(&steal_idle_cores);
+    else
+        atomic_fetch_and_sub(&steal_idle_cores, 1);
+}
+
+static void nvme_be_backlog_del(struct nvme_tenant_mgmt *mgmt,
+                                struct nvme_sw_queue *swq) {
+    list_del(&swq->list);
+    swq->backlogged = false;
+    mgmt->num_be_backlogged--;
+    mgmt->be_backlog_weight -= nvme_fgs[swq->fg_handle].sched_weight;
+}
+
+/*
+ * nvme_steal_publish - offer requests of the backlogged best-effort tenants
+ *
+ * Takes one request per tenant in turn from the head of its queue, once the
+ * previous batch is gone and paid for. Tokens a tenant saved towards
+ * requests it gave away are dropped.
+ */
+static void nvme_steal_publish(struct nvme_tenant_mgmt *mgmt) {
+    struct nvme_steal_ring *ring = &steal_rings[percpu_get(cpu_nr)];
+    struct nvme_sw_queue *swq, *next;
+    struct nvme_ctx *ctx;
+    unsigned long head = ring->head;
+    int n = 0, last;
+
+    if (!atomic_read(&steal_idle_cores) || percpu_get(steal_debt) ||
+        head != atomic_u64_read(&ring->tail))
+        return;
+
+    do {
+        last = n;
+        list_for_each_safe(&mgmt->be_backlog, swq, next, list) {
+            if (n == NVME_STEAL_BATCH) break;
+            if (nvme_sw_queue_pop_front(swq, &ctx)) continue;
+            ring->buf[(head + n++) % NVME_STEAL_BATCH] = ctx;
+            swq->saved_tokens =
+                min(swq->saved_tokens, swq->total_token_demand);
+            if (nvme_sw_queue_isempty(swq)) nvme_be_backlog_del(mgmt, swq);
+        }
+    } while (n > last && n < NVME_STEAL_BATCH);
+
+    // the requests must be visible before the head that covers them
+    rte_smp_wmb();
+    ring->head = head + n;
+}
+
+/*
+ * nvme_steal_reclaim - issue what nobody stole of the core's last batch
+ *
+ * The requests are paid for afterwards (see nvme_steal_repay()) so they
+ * don't starve behind newer requests of the same tenants.
+ */
+static void nvme_steal_reclaim(void) {
+    struct nvme_steal_ring *ring = &steal_rings[percpu_get(cpu_nr)];
+    struct nvme_ctx *ctx;
+    unsigned long t;
+
+    while ((t = atomic_u64_read(&ring->tail)) != ring->head) {
+        ctx = ring->buf[t % NVME_STEAL_BATCH];
+        if (!atomic_u64_cmpxchg(&ring->tail, t, t + 1)) continue;
+        percpu_get(steal_debt) += ctx->req_cost;
+        issue_nvme_req(ctx);
     }
 }
 
+/*
+ * nvme_steal_repay - pay for reclaimed requests out of tokens
+ *
+ * Returns the tokens left.
+ */
+static inline unsigned long nvme_steal_repay(unsigned long tokens) {
+    unsigned long paid = min(tokens, percpu_get(steal_debt));
+
+    percpu_get(steal_debt) -= paid;
+    return tokens - paid;
+}
+
+/*
+ * nvme_steal_from - issue requests offered by core cpu for tokens, topped
+ * up from the leftover pool, while this core's qpair has room
+ *
+ * Returns the tokens left.
+ */
+static unsigned long nvme_steal_from(int cpu, unsigned long tokens) {
+    struct nvme_steal_ring *ring = &steal_rings[cpu];
+    struct spdk_nvme_ns *ns = nvme_local_ns();
+    struct nvme_ctx *ctx;
+    unsigned long t;
+
+    while (list_empty(&percpu_get(nvme_deferred))) {
+        t = atomic_u64_read(&ring->tail);
+        if (t == ring->head) break;
+        rte_smp_rmb();
+        // ctx may be claimed meanwhile, then the cmpxchg fails
+        ctx = ring->buf[t % NVME_STEAL_BATCH];
+        if (ctx->ns != ns) break;
+        if (ctx->req_cost > tokens)
+            tokens += try_acquire_global_tokens(ctx->req_cost - tokens);
+        if (ctx->req_cost > tokens) break;
+        if (!atomic_u64_cmpxchg(&ring->tail, t, t + 1)) continue;
+
+        tokens -= ctx->req_cost;
+        nvme_submit_or_defer(ctx);
+    }
+    return tokens;
+}
+
+/*
+ * nvme_steal - spend spare tokens on requests offered by other cores
+ *
+ * Returns the tokens left.
+ */
+static unsigned long nvme_steal(unsigned long tokens) {
+    int i, cpu = percpu_get(cpu_nr);
+
+    if (!nvme_steal_enabled()) return tokens;
+
+    nvme_steal_set_idle(true);
+    for (i = 1; i < cpus_active; i++)
+        tokens = nvme_steal_from((cpu + i) % cpus_active, tokens);
+    return tokens;
+}
+
 /*
  * nvme_sched_subround1: schedule latency critical tenant traffic
  */
 static inline int nvme_sched_subround1(void) {
     struct nvme_tenant_mgmt *thread_tenant_manager;
     struct nvme_sw_queue *nvme_swq;
+    struct nvme_sw_queue **heap;
     struct nvme_ctx *ctx;
     unsigned long now;
     unsigned long time_delta;
+    int i, n = 0;
     long POS_LIMIT = 0;
+    long giveaway;
     unsigned long local_leftover = 0;
     unsigned long local_demand = 0;
-    double token_increment;
+    unsigned long lc_boost;
+    struct nvme_flow_group *fg;
 
-    now = timer_now();  // in us
+    now = rdtsc();
     time_delta = now - percpu_get(last_sched_time);
     percpu_get(last_sched_time) = now;
 
     thread_tenant_manager = &percpu_get(nvme_tenant_manager);
+    heap = thread_tenant_manager->lc_heap;
+    lc_boost = atomic_u64_read(&global_lc_boost_no_BE);
+
+    // credit latency-critical (LC) tenants, index the ones that can issue
+    list_for_each(&thread_tenant_manager->lc_tenants, nvme_swq, list) {
+        fg = &nvme_fgs[nvme_swq->fg_handle];
+        nvme_swq->token_increment = tokens_earned(
+            fg->token_rate_fp + nvme_fg_boost_fp(fg, lc_boost), time_delta,
+            &nvme_swq->token_frac);
+        nvme_swq->token_credit += nvme_swq->token_increment;
+        if (nvme_swq->token_credit < -TOKEN_DEFICIT_LIMIT) {
+            /*
+             * Notify control plane, may need to re-negotiate tenant SLO
+             * FUTURE WORK: implement control plane
+             */
 
-    list_for_each(&thread_tenant_manager->tenant_swq, nvme_swq, list) {
-        // serve latency-critical (LC) tenants
-        if (nvme_fgs[nvme_swq->fg_handle].latency_critical_flag) {
-            if (nvme_swq->fg_handle == 2) {
-                // printf("%f\n",
-                // nvme_fgs[nvme_swq->fg_handle].scaled_IOPuS_limit);
-            }
+            // TODO: try to grab from global token bucket
+            // NOTE: may also need to schedule LC tenants in round robin for
+            // fairness
+        }
+        if (nvme_sw_queue_isempty(nvme_swq) == 0 &&
+            nvme_swq->token_credit > -TOKEN_DEFICIT_LIMIT)
+            heap[n++] = nvme_swq;
+    }
 
-            token_increment =
-                (nvme_fgs[nvme_swq->fg_handle].scaled_IOPuS_limit *
-                 time_delta) +
-                0.5;  // 0.5 is for rounding
-            nvme_swq->token_credit += (long)token_increment;
-            if (nvme_swq->token_credit < -TOKEN_DEFICIT_LIMIT) {
-                /*
-                 * Notify control plane, may need to re-negotiate tenant SLO
-                 * FUTURE WORK: implement control plane
-                 */
-
-                // TODO: try to grab from global token bucket
-                // NOTE: may also need to schedule LC tenants in round robin for
-                // fairness
-            }
-            while (nvme_sw_queue_isempty(nvme_swq) == 0 &&
-                   nvme_swq->token_credit > -TOKEN_DEFICIT_LIMIT) {
-                nvme_sw_queue_pop_front(nvme_swq, &ctx);
-                issue_nvme_req(ctx);
-                nvme_swq->token_credit -= ctx->req_cost;
-            }
+    /*
+     * Serve LC requests earliest deadline first across tenants, each tenant
+     * still limited by its own token credit.
+     */
+    for (i = n / 2 - 1; i >= 0; i--) lc_heap_sift_down(heap, n, i);
+    while (n) {
+        nvme_swq = heap[0];
+        nvme_sw_queue_pop_earliest(nvme_swq, &ctx);
+        issue_nvme_req(ctx);
+        nvme_swq->token_credit -= ctx->req_cost;
 
-            /*
-             * POS_LIMIT can be tuned to balance work-conservation and favoring
-             *of LC traffic
-             *	  * default POS_LIMIT    = 3 * token_increment
-             *	  						if LC tenant
-             *doesn't use tokens accumulated from ~3 sched rounds, donate them
-             *
-             *   * lower POS_LIMIT 		is good for work-conservation
-             *   						(give tokens to
-             *BE tenants more easily)
-             *
-             *   * higher POS_LIMIT 	allows latency-critical tenants to
-             *accumulate more tokens & burst
-             */
-            POS_LIMIT = 3 * token_increment;
-            if (nvme_swq->token_credit > POS_LIMIT) {
-                local_leftover +=
-                    (nvme_swq->token_credit * TOKEN_FRAC_GIVEAWAY);
-                nvme_swq->token_credit -=
-                    nvme_swq->token_credit * TOKEN_FRAC_GIVEAWAY;
-            }
-        } else {  // track demand of best-effort (will need for subround2)
-            local_demand +=
-                nvme_swq->total_token_demand - nvme_swq->saved_tokens;
+        if (nvme_sw_queue_isempty(nvme_swq) ||
+            nvme_swq->token_credit <= -TOKEN_DEFICIT_LIMIT)
+            heap[0] = heap[--n];
+        if (n) lc_heap_sift_down(heap, n, 0);
+    }
+
+    list_for_each(&thread_tenant_manager->lc_tenants, nvme_swq, list) {
+        /*
+         * POS_LIMIT can be tuned to balance work-conservation and favoring
+         *of LC traffic
+         *	  * default POS_LIMIT    = 3 * token_increment
+         *	  						if LC tenant
+         *doesn't use tokens accumulated from ~3 sched rounds, donate them
+         *
+         *   * lower POS_LIMIT 		is good for work-conservation
+         *   						(give tokens to
+         *BE tenants more easily)
+         *
+         *   * higher POS_LIMIT 	allows latency-critical tenants to
+         *accumulate more tokens & burst
+         */
+        POS_LIMIT = 3 * nvme_swq->token_increment;
+        if (nvme_swq->token_credit > POS_LIMIT) {
+            giveaway = nvme_swq->token_credit * TOKEN_GIVEAWAY_PCT / 100;
+            local_leftover += giveaway;
+            nvme_swq->token_credit -= giveaway;
         }
     }
 
+    // track demand of best-effort tenants (will need for subround2)
+    list_for_each(&thread_tenant_manager->be_backlog, nvme_swq, list) {
+        local_demand += nvme_swq->total_token_demand - nvme_swq->saved_tokens;
+    }
+
     percpu_get(local_extra_demand) = local_demand;
     percpu_get(local_leftover_tokens) = local_leftover;
 
@@ -1389,13 +3048,15 @@ static inline int nvme_sched_subround1(void) {
  */
 static inline void nvme_sched_subround2(void) {
     struct nvme_tenant_mgmt *thread_tenant_manager;
-    struct nvme_sw_queue *nvme_swq;
+    struct nvme_sw_queue *nvme_swq, *next, *first;
     struct nvme_ctx *ctx;
-    int i;
     unsigned long local_leftover = 0;
     unsigned long local_demand = 0;
     unsigned long be_tokens = 0;
-    double token_increment = 0;
+    unsigned long weight_tokens;
+    unsigned long deficit;
+    unsigned long weight;
+    unsigned long idle_weight;
     unsigned long token_demand = 0;
     unsigned long global_tokens_acquired = 0;
     unsigned long now;
@@ -1406,17 +3067,20 @@ static inline void nvme_sched_subround2(void) {
 
     thread_tenant_manager = &percpu_get(nvme_tenant_manager);
 
+    if (nvme_steal_enabled()) nvme_steal_reclaim();
+
     // compare local leftover with local demand
     // synchronize access to global token bucket
     if (local_leftover > 0 &&
         local_demand == 0) {  // give away leftoever tokens to global pool
-        atomic_u64_fetch_and_add(&global_leftover_tokens, local_leftover);
+        local_leftover = nvme_steal(nvme_steal_repay(local_leftover));
+        if (local_leftover) donate_leftover_tokens(local_leftover);
         return;
     } else if (local_leftover <
                local_demand) {  // try to get how much you need from global pool
         token_demand = local_demand - local_leftover;
         global_tokens_acquired =
-            try_acquire_global_tokens(token_demand);  // atomic
+            try_acquire_global_tokens(token_demand);
         be_tokens = local_leftover + global_tokens_acquired;
     } else if (local_leftover >= local_demand) {
         be_tokens = local_leftover;
@@ -1426,118 +3090,201 @@ static inline void nvme_sched_subround2(void) {
     time_delta_cycles = now - percpu_get(last_sched_time_be);
     percpu_get(last_sched_time_be) = now;
 
-    // serve best effort tenants in round-robin order
-    // TODO: simplify by implementing separate per-thread lists of BE and LC
-    // tenants
-    i = 0;
-    list_for_each(&thread_tenant_manager->tenant_swq, nvme_swq, list) {
-        if (i < percpu_get(roundrobin_start)) {
-            i++;
-            continue;
-        }
-        if (!nvme_fgs[nvme_swq->fg_handle].latency_critical_flag) {
-            be_tokens += nvme_sw_queue_take_saved_tokens(nvme_swq);
-            token_increment = (atomic_read(&global_be_token_rate_per_tenant) *
-                               time_delta_cycles) /
-                              (double)(cycles_per_us * 1E6);
-            be_tokens += (long)(token_increment + 0.5);
-
-            while ((nvme_sw_queue_isempty(nvme_swq) == 0) &&
-                   nvme_sw_queue_peak_head_cost(nvme_swq) <= be_tokens) {
-                nvme_sw_queue_pop_front(nvme_swq, &ctx);
-                issue_nvme_req(ctx);
-                be_tokens -= ctx->req_cost;
-            }
-            // save extra tokens for this tenant if still has demand
-            be_tokens -= nvme_sw_queue_save_tokens(nvme_swq, be_tokens);
-            assert(be_tokens >= 0);
+    // tokens earned per unit of weight; idle tenants pass theirs on
+    weight_tokens =
+        tokens_earned(atomic_u64_read(&global_be_token_rate_per_weight),
+                      time_delta_cycles, &percpu_get(be_token_frac));
+    idle_weight = thread_tenant_manager->be_weight -
+                  thread_tenant_manager->be_backlog_weight;
+    be_tokens += nvme_weighted_tokens(weight_tokens, idle_weight,
+                                      &percpu_get(be_idle_frac));
+
+    /*
+     * Weighted deficit round robin over backlogged best-effort tenants: each
+     * gets its own earnings plus a weighted slice of the spare tokens. What
+     * it can't spend yet is kept as its deficit (saved tokens) while it has
+     * demand, the rest goes back to the global pool. Reclaimed steal
+     * batches are paid for first.
+     */
+    if (thread_tenant_manager->be_backlog_weight) {
+        be_tokens += nvme_weighted_tokens(
+            weight_tokens, thread_tenant_manager->be_backlog_weight,
+            &percpu_get(be_pool_frac));
+        be_tokens = nvme_steal_repay(be_tokens);
+        weight_tokens = (be_tokens << NVME_SHARE_SHIFT) /
+                        thread_tenant_manager->be_backlog_weight;
+        // round up so the slices never add up to more than be_tokens
+        be_tokens -= (weight_tokens * thread_tenant_manager->be_backlog_weight +
+                      NVME_SHARE_ONE - 1) >>
+                     NVME_SHARE_SHIFT;
+    } else {
+        be_tokens = nvme_steal_repay(be_tokens);
+    }
+    first = list_top(&thread_tenant_manager->be_backlog, struct nvme_sw_queue,
+                     list);
+    list_for_each_safe(&thread_tenant_manager->be_backlog, nvme_swq, next,
+                       list) {
+        weight = nvme_fgs[nvme_swq->fg_handle].sched_weight;
+        deficit = nvme_sw_queue_take_saved_tokens(nvme_swq) +
+                  nvme_weighted_tokens(weight_tokens, weight,
+                                       &nvme_swq->token_frac);
+
+        while ((nvme_sw_queue_isempty(nvme_swq) == 0) &&
+               nvme_sw_queue_peak_head_cost(nvme_swq) <= deficit) {
+            nvme_sw_queue_pop_front(nvme_swq, &ctx);
+            issue_nvme_req(ctx);
+            deficit -= ctx->req_cost;
         }
-        i++;
+        be_tokens += deficit - nvme_sw_queue_save_tokens(nvme_swq, deficit);
+
+        if (nvme_sw_queue_isempty(nvme_swq))
+            nvme_be_backlog_del(thread_tenant_manager, nvme_swq);
     }
 
-    int j = 0;
-    list_for_each(&thread_tenant_manager->tenant_swq, nvme_swq, list) {
-        if (j >= percpu_get(roundrobin_start)) {
-            break;
-        }
-        log_debug("schedule tenant second %d\n", j);
-        // log_debug("subround2: sched tenant handle %ld, tenant_tokens %lu\n",
-        // nvme_swq->fg_handle, tenant_tokens);
-        if (!nvme_fgs[nvme_swq->fg_handle].latency_critical_flag) {
-            be_tokens += nvme_sw_queue_take_saved_tokens(nvme_swq);
-            token_increment = (atomic_read(&global_be_token_rate_per_tenant) *
-                               time_delta_cycles) /
-                              (double)(cycles_per_us * 1E6);
-            be_tokens += (long)(token_increment + 0.5);
-
-            while ((nvme_sw_queue_isempty(nvme_swq) == 0) &&
-                   nvme_sw_queue_peak_head_cost(nvme_swq) <= be_tokens) {
-                nvme_sw_queue_pop_front(nvme_swq, &ctx);
-                issue_nvme_req(ctx);
-                be_tokens -= ctx->req_cost;
-            }
-            // save extra tokens for this tenant if still has demand
-            be_tokens -= nvme_sw_queue_save_tokens(nvme_swq, be_tokens);
-            assert(be_tokens >= 0);
-        }
-        j++;
-    }
-
-    int done = 0;
-    if (thread_tenant_manager->num_best_effort_tenants > 0) {
-        while (1) {  // find next round-robin start and check it's a best-effort
-                     // tenant (otherwise unfair)
-            percpu_get(roundrobin_start) = (percpu_get(roundrobin_start) + 1) %
-                                           thread_tenant_manager->num_tenants;
-            i = 0;
-            list_for_each(&thread_tenant_manager->tenant_swq, nvme_swq, list) {
-                if (i != percpu_get(roundrobin_start)) {
-                    i++;
-                    continue;
-                }
-                if (!nvme_fgs[nvme_swq->fg_handle].latency_critical_flag) {
-                    done = 1;  // incremented to next best effort tenant
-                }
-                break;
-            }
-            if (done == 1) {
-                break;
-            }
-        }
+    // the next round starts with the tenant after this round's first
+    if (first && first->backlogged) {
+        list_del(&first->list);
+        list_add_tail(&thread_tenant_manager->be_backlog, &first->list);
+    }
+
+    if (list_empty(&thread_tenant_manager->be_backlog)) {
+        be_tokens = nvme_steal(be_tokens);
+    } else if (nvme_steal_enabled()) {
+        nvme_steal_set_idle(false);
+        nvme_steal_publish(thread_tenant_manager);
     }
 
     if (be_tokens > 0) {
-        atomic_u64_fetch_and_add(&global_leftover_tokens, be_tokens);
+        donate_leftover_tokens(be_tokens);
     }
 }
 
 /*
- * update_scheduler_bitvector:
- * 		- synchronizes clearing of the global token bucket to limit
- * global BE token accumulation
- * 		- mark global bitvector to indicate this thread has completed a
- * scheduling round
- * 		- if last thread to complete a round, clear the global vector
- * 		- updates to global vector are not atomic operations because
- * want to limit perf overhead and the exact timing of token bucket reset is not
- * critical, as long as we reset approximately after each thread has had a
- * chance to get tokens
+ * token_epoch_checkin - mark that this core has completed a scheduling round
+ *
+ * Each core checks in once per epoch; the last one advances the epoch, which
+ * expires all leftover tokens so best-effort tokens don't accumulate beyond
+ * roughly one round of every core. Rounds within an already checked-in epoch
+ * only read the epoch word.
  */
-static void update_scheduled_bitvector(void) {
+static void token_epoch_checkin(void) {
+    unsigned long old, new, epoch;
+
+    do {
+        old = atomic_u64_read(&token_epoch);
+        epoch = old >> NVME_EPOCH_SHIFT;
+        if (epoch == percpu_get(token_epoch_seen)) return;
+
+        if ((old & NVME_EPOCH_LOW) + 1 < cpus_active)
+            new = old + 1;
+        else
+            new = (epoch + 1) << NVME_EPOCH_SHIFT;
+    } while (!atomic_u64_cmpxchg(&token_epoch, old, new));
+
+    percpu_get(token_epoch_seen) = epoch;
+}
+
+/*
+ * nvme_tenant_rebalance - split shared tenants' budgets by recent demand
+ *
+ * Every core publishes the smoothed demand of its flow group of a tenant
+ * in its own slot and derives its share from all of them, so rebalancing
+ * takes no lock and the shares add up to the whole budget once all cores
+ * have seen the same demand. A core whose share rounds down to nothing
+ * keeps the smallest one while it has requests queued, or they would
+ * never be scheduled again.
+ */
+static void nvme_tenant_rebalance(void) {
+    struct nvme_tenant_mgmt *mgmt = &percpu_get(nvme_tenant_manager);
+    struct nvme_flow_group *fg;
+    struct nvme_tenant *t;
+    unsigned long mine, sum, share;
     int i;
-    scheduled_bit_vector[RTE_PER_LCORE(cpu_nr)]++;
 
-    for (i = 0; i < cpus_active; i++) {
-        if (scheduled_bit_vector[i] == 0) break;
+    list_for_each(&mgmt->shared_fgs, fg, tenant_link) {
+        t = fg->tenant;
+        mine = (atomic_u64_read(&t->demand[percpu_get(cpu_nr)].tokens) * 3 +
+                fg->demand) / 4;
+        fg->demand = 0;
+        atomic_u64_write(&t->demand[percpu_get(cpu_nr)].tokens, mine);
+
+        sum = 0;
+        for (i = 0; i < cpus_active; i++)
+            sum += atomic_u64_read(&t->demand[i].tokens);
+        share = ((mine + 1) << NVME_SHARE_SHIFT) /
+                (sum + atomic_read(&t->nr_cores));
+        if (!share && !nvme_sw_queue_isempty(fg->nvme_swq)) share = 1;
+        nvme_fg_set_share(fg, share);
     }
-    if (i == cpus_active) {  // all other threads scheduled at least once
-        atomic_u64_write(&global_leftover_tokens, 0);
+}
 
-        // clear scheduled bit vector
-        for (i = 0; i < cpus_active; i++) {
-            scheduled_bit_vector[i] = 0;
+static inline unsigned long devmodel_token_rate(int i) {
+    return global_readonly_flag ? dev_model[i].token_rdonly_rate_limit
+                                : dev_model[i].token_rate_limit;
+}
+
+/*
+ * nvme_tail_control - one step of the tail latency feedback loop
+ *
+ * The step is proportional to how far the worst device tail is from the
+ * strictest SLO, capped at -20%/+5% per interval so the rate backs off fast
+ * and probes up slowly; nothing changes while the tail sits just under the
+ * SLO. The rate stays within the devmodel curve and never drops below the
+ * sum of the LC reservations.
+ */
+static void nvme_tail_control(void) {
+    uint32_t win[NVME_LAT_BUCKETS], now;
+    uint64_t total;
+    unsigned long tail = 0, p95, p99, lo, hi, rate;
+    int dev, b, c, w, ndev = nvme_num_devices();
+    double step;
+
+    for (dev = 0; dev < ndev; dev++) {
+        total = 0;
+        for (b = 0; b < NVME_LAT_BUCKETS; b++) {
+            now = 0;
+            for (c = 0; c < MAX_NUM_THREADS; c++) now += lat_hist[c][dev][b];
+            lat_window[lat_window_slot][dev][b] = now - lat_hist_seen[dev][b];
+            lat_hist_seen[dev][b] = now;
+
+            win[b] = 0;
+            for (w = 0; w < NVME_TAIL_WINDOW; w++)
+                win[b] += lat_window[w][dev][b];
+            total += win[b];
         }
+        if (total < NVME_TAIL_MIN_SAMPLES) continue;
+
+        p95 = lat_percentile(win, total, 95);
+        p99 = lat_percentile(win, total, 99);
+        cp_shmem->nvme.p95_lat_us[dev] = p95;
+        cp_shmem->nvme.p99_lat_us[dev] = p99;
+        tail = max(tail, CFG.nvme_tail_pct == 99 ? p99 : p95);
+    }
+    lat_window_slot = (lat_window_slot + 1) % NVME_TAIL_WINDOW;
+    cp_shmem->nvme.nr_devices = ndev;
+    cp_shmem->nvme.tail_pct = CFG.nvme_tail_pct;
+    cp_shmem->nvme.target_lat_us =
+        global_lat_SLO == UINT_MAX ? 0 : global_lat_SLO;
+
+    if (!tail || global_lat_SLO == UINT_MAX) return;
+    if (nvme_dev_model != FLASH_DEV_MODEL && nvme_dev_model != EMULATED_FLASH)
+        return;
+
+    if (tail <= global_lat_SLO &&
+        tail >= NVME_TAIL_CTRL_DEADBAND * global_lat_SLO)
+        return;
+    step = 1 + NVME_TAIL_CTRL_GAIN * ((double)global_lat_SLO / tail - 1);
+    step = max(min(step, NVME_TAIL_CTRL_MAX_UP), NVME_TAIL_CTRL_MAX_DOWN);
+
+    spin_lock(&nvme_bitmap_lock);
+    lo = max(devmodel_token_rate(0), global_LC_sum_token_rate);
+    hi = max(devmodel_token_rate(dev_model_size - 1), lo);
+    rate = min(max((unsigned long)(global_token_rate * step), lo), hi);
+    if (hi && rate != global_token_rate) {
+        global_token_rate = rate;
+        update_tenant_token_rates();
     }
+    spin_unlock(&nvme_bitmap_lock);
 }
 
 int nvme_sched(void) {
@@ -1545,22 +3292,40 @@ int nvme_sched(void) {
     return 0;
 #endif
     struct nvme_tenant_mgmt *thread_tenant_manager;
+    unsigned long idle_tokens;
     thread_tenant_manager = &percpu_get(nvme_tenant_manager);
 
+    if (CFG.nvme_tail_pct && percpu_get(cpu_nr) == 0 &&
+        timer_now() - last_tail_ctrl_time >= NVME_TAIL_CTRL_INTERVAL_US) {
+        last_tail_ctrl_time = timer_now();
+        nvme_tail_control();
+    }
+
     if (thread_tenant_manager->num_tenants == 0) {
-        percpu_get(last_sched_time) = timer_now();
+        percpu_get(last_sched_time) = rdtsc();
         percpu_get(last_sched_time_be) = rdtsc();
-        update_scheduled_bitvector();
+        // no tenants of its own, steal with tokens from the leftover pool
+        idle_tokens = nvme_steal(0);
+        if (idle_tokens) donate_leftover_tokens(idle_tokens);
+        token_epoch_checkin();
         return 0;
     }
 
+    if (!list_empty(&thread_tenant_manager->shared_fgs) &&
+        timer_now() - percpu_get(last_rebalance_time) >=
+            NVME_TENANT_REBALANCE_US) {
+        percpu_get(last_rebalance_time) = timer_now();
+        nvme_tenant_rebalance();
+    }
+
     nvme_sched_subround1();  // serve latency-critical tenants
     nvme_sched_subround2();  // serve best-effort tenants
+    nvme_merge_flush();
 
     percpu_get(local_leftover_tokens) = 0;
     percpu_get(local_extra_demand) = 0;
 
-    update_scheduled_bitvector();
+    token_epoch_checkin();
 
     return 0;
 }
@@ -1569,14 +3334,25 @@ void nvme_process_completions() {
     int i;
     int max_completions = 4096;
 
-    if (CFG.num_nvmedev == 0 || CFG.ns_sizes[0] != 0) return;
+    if (!nvme_enabled()) return;
 
     for (i = 0; i < percpu_get(open_ev_ptr); i++) {
         usys_nvme_opened(percpu_get(open_ev[i]), global_ns_size,
-                         global_ns_sector_size);
+                         global_ns_sector_size, global_ns_open_flags);
         percpu_get(received_nvme_completions)++;
     }
     percpu_get(open_ev_ptr) = 0;
-    percpu_get(received_nvme_completions) +=
-        spdk_nvme_qpair_process_completions(percpu_get(qpair), max_completions);
+    if (CFG.stripe_unit && nvme_dev_model != EMULATED_FLASH) {
+        for (i = 0; i < stripe_width; i++)
+            percpu_get(received_nvme_completions) +=
+                nvme_poll_qpair(i, max_completions);
+    } else {
+        percpu_get(received_nvme_completions) +=
+            nvme_poll_qpair(0, max_completions);
+    }
+
+    nvme_drain_remote();
+
+    // completions freed qpair slots, resubmit what was waiting for them
+    nvme_retry_deferred();
 }